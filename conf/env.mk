@@ -14,6 +14,12 @@ V = @
 #
 # GCCPREFIX=''
 
+# Build profile: 0 for a release build with debug bookkeeping compiled out
+# of hot paths and -O2, 1 (the default) for a debug build, 2 for a debug
+# build with extra expensive checks.  Each builds in its own directory.
+#
+# PIOS_DEBUG=1
+
 # If the makefile cannot find your QEMU binary, uncomment the
 # following line and set it to the full path to QEMU.
 #
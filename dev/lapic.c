@@ -17,10 +17,15 @@
 #include <kern/cpu.h>
 
 #include <dev/lapic.h>
+#include <dev/pit.h>
 
 
 volatile uint32_t *lapic;  // Initialized in mp.c
 
+uint64_t lapic_hz;
+
+static bool lapic_tscdl;	// Timer runs in TSC-deadline mode
+
 
 static void
 lapicw(int index, int value)
@@ -29,6 +34,60 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the timer's count rate against the TSC,
+// which pit_init() has already calibrated.
+static void
+lapic_calibrate(void)
+{
+	if (pit_tschz == 0) {
+		warn("lapic: no TSC rate to calibrate the timer against");
+		return;
+	}
+
+	// Count down once, masked, from as far as we can for LAPIC_CALMS.
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED | ONESHOT | T_LTIMER);
+	uint64_t t0 = rdtsc();
+	lapicw(TICR, 0xffffffff);
+	while (rdtsc() - t0 < pit_tschz / 1000 * LAPIC_CALMS)
+		pause();
+	uint32_t count = 0xffffffff - lapic[TCCR];
+	uint64_t t = rdtsc() - t0;
+	lapicw(TICR, 0);
+
+	lapic_hz = count * pit_tschz / t;
+
+	// Where we can, set timer deadlines on the TSC directly instead.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	lapic_tscdl = (inf.ecx & CPUID_ECX_TSCDL) != 0;
+
+	cprintf("lapic: bus runs at %lld kHz, timer ticks every %d us%s\n",
+		lapic_hz / 1000, LAPIC_TICK_US,
+		lapic_tscdl ? " (TSC deadline)" : "");
+}
+
+// Arm the timer to go off once, 'us' microseconds from now,
+// or disarm it if 'us' is 0.
+static void
+lapic_arm(uint32_t us)
+{
+	if (lapic_tscdl) {
+		wrmsr(MSR_TSCDL, us ? rdtsc() + pit_tschz * us / 1000000 : 0);
+		return;
+	}
+
+	// Without a calibration, fall back on a tick that is about
+	// the right length under QEMU.
+	uint64_t count = lapic_hz ? lapic_hz * us / 1000000
+			: 60000000ULL * us / LAPIC_TICK_US;
+	if (count == 0 && us != 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	lapicw(TICR, count);
+}
+
 void
 lapic_init()
 {
@@ -38,16 +97,18 @@ lapic_init()
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | T_LTIMER);
+	// Every CPU's timer runs at the same bus frequency,
+	// so we only need to measure it once.
+	if (cpu_onboot())
+		lapic_calibrate();
 
-	// If we cared more about precise timekeeping,
-	// we would calibrate TICR with another time source such as the PIT.
-	//lapicw(TICR, 10000000);
-	//lapicw(TICR, 10000000);
-	lapicw(TICR, 60000000);
+	// The timer counts down once at bus frequency from lapic[TICR],
+	// or waits for the TSC to reach a deadline, and then interrupts;
+	// lapic_nexttick() sets it going again for each tick.
+	// It stays off until the scheduler wants ticks (see lapic_settick()).
+	lapicw(TDCR, X1);
+	lapicw(TIMER, (lapic_tscdl ? TSCDEADLINE : ONESHOT) | T_LTIMER);
+	cpu_cur()->tickus = 0;
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -83,6 +144,28 @@ lapic_init()
 	lapicw(TPR, 0);
 }
 
+void
+lapic_settick(uint32_t us)
+{
+	cpu *c = cpu_cur();
+	if (!lapic || c->tickus == us)
+		return;
+
+	// Don't let a tick going off in between re-arm the old length.
+	cpu_cli();
+	c->tickus = us;
+	lapic_arm(us);
+	cpu_sti();
+}
+
+void
+lapic_nexttick(void)
+{
+	cpu *c = cpu_cur();
+	if (lapic && c->tickus != 0)
+		lapic_arm(c->tickus);
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
@@ -98,6 +181,22 @@ void lapic_errintr(void)
 	warn("CPU%d LAPIC error: ESR %x", cpu_cur()->id, lapic[ESR]);
 }
 
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+
+	// The two halves of the ICR must be written together:
+	// don't let an interrupt handler on this CPU send an IPI in between.
+	cpu_cli();
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		pause();
+	cpu_sti();
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
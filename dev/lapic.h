@@ -20,6 +20,18 @@
 // Must be at least 19Hz in order to keep the system type up-to-date.
 #define HZ		25
 
+// Length of a timer tick in microseconds, which is the basic time slice
+// (see PROC_SLICE in kern/proc.h), unless a process asks for its own
+// with SYS_SCHED (see inc/syscall.h).  Override with make DEFS=.
+// A CPU only takes ticks while its running process has others
+// to take turns with (see proc_settick()); otherwise its timer is off.
+#ifndef LAPIC_TICK_US
+#define LAPIC_TICK_US	(1000000 / HZ)
+#endif
+#define LAPIC_TICK_MIN	100		// Shortest tick allowed, in us
+#define LAPIC_TICK_MAX	1000000		// Longest tick allowed, in us
+#define LAPIC_CALMS	10		// Milliseconds to calibrate the timer
+
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)	// ID
@@ -34,6 +46,7 @@
   #define ENABLE     0x00000100   // Unit Enable
 #define ESR     (0x0280/4)	// Error Status
 #define ICRLO   (0x0300/4)	// Interrupt Command
+  #define FIXED      0x00000000   // Interrupt at the given vector
   #define INIT       0x00000500   // INIT/RESET
   #define STARTUP    0x00000600   // Startup IPI
   #define DELIVS     0x00001000   // Delivery status
@@ -43,7 +56,9 @@
 #define ICRHI   (0x0310/4)	// Interrupt Command [63:32]
 #define TIMER   (0x0320/4)	// Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
+  #define ONESHOT    0x00000000   // One-shot
   #define PERIODIC   0x00020000   // Periodic
+  #define TSCDEADLINE 0x00040000  // Interrupt when TSC reaches MSR_TSCDL
 #define PCINT   (0x0340/4)	// Performance Counter LVT
 #define LINT0   (0x0350/4)	// Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)	// Local Vector Table 2 (LINT1)
@@ -53,11 +68,17 @@
 #define TCCR    (0x0390/4)	// Timer Current Count
 #define TDCR    (0x03E0/4)	// Timer Divide Configuration
 
+#define MSR_TSCDL	0x6E0		// TSC deadline for TSCDEADLINE mode
+
 
 // Pointer to local APIC - mapped at same physical address on every CPU.
 // Initialized in mp.c
 extern volatile uint32_t *lapic;
 
+// Rate at which the LAPIC timer counts with divide-by-1, i.e.,
+// the bus frequency, measured by lapic_init() (0 if unknown).
+extern uint64_t lapic_hz;
+
 
 // Initialize current CPU's local APIC
 void lapic_init(void);
@@ -65,11 +86,23 @@ void lapic_init(void);
 // Acknowledge interrupt
 void lapic_eoi(void);
 
+// Set this CPU's timer to tick every 'us' microseconds,
+// restarting the current tick if that's a change,
+// or stop its ticks altogether if 'us' is 0.
+void lapic_settick(uint32_t us);
+
+// Arm the timer for the next tick, when one has just gone off.
+void lapic_nexttick(void);
+
 // Handle local APIC error interrupt
 void lapic_errintr(void);
 
 // Send a message to start an Application Processor (AP) running at addr.
 void lapic_startcpu(uint8_t apicid, uint32_t addr);
 
+// Send an inter-processor interrupt to the given vector
+// to the CPU with the given local APIC ID.
+void lapic_ipi(uint8_t apicid, int vector);
+
 
 #endif /* !PIOS_DEV_LAPIC_H */
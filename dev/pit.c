@@ -0,0 +1,52 @@
+/*
+ * Driver for the 8253/8254 Programmable Interval Timer (PIT).
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+
+#include <dev/pit.h>
+
+
+uint64_t pit_tschz;
+
+void
+pit_init(void)
+{
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	// Enable channel 2's gate, but keep the PC speaker quiet.
+	outb(IO_PPI, (inb(IO_PPI) & ~0x02) | 0x01);
+
+	// Count down once from a PIT_CALMS interval in mode 0
+	// (interrupt on terminal count): channel 2's output goes high
+	// when the count reaches zero, which we can see on the PPI.
+	uint32_t count = PIT_FREQ / (1000 / PIT_CALMS);
+	outb(PIT_MODE, 0xb0);		// channel 2, lo/hi byte, mode 0, binary
+	outb(PIT_CH2, count & 0xff);
+	outb(PIT_CH2, count >> 8);
+
+	// If the output never goes high, say because channel 2's gate
+	// isn't wired as on a PC, give up after 100 times as long as
+	// the count should take even on the fastest TSC.
+	uint64_t t0 = rdtsc();
+	uint64_t limit = PIT_MAXTSCHZ / (1000 / PIT_CALMS) * 100;
+	while ((inb(IO_PPI) & 0x20) == 0) {
+		if (rdtsc() - t0 > limit) {
+			warn("pit: channel 2 never counted down: "
+				"TSC rate unknown");
+			return;		// leave pit_tschz 0
+		}
+		pause();
+	}
+	pit_tschz = (rdtsc() - t0) * (1000 / PIT_CALMS);
+
+	cprintf("pit: TSC runs at %lld kHz\n", pit_tschz / 1000);
+}
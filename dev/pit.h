@@ -0,0 +1,34 @@
+/*
+ * Definitions for the 8253/8254 Programmable Interval Timer (PIT).
+ * The kernel uses it only as a reference clock for calibrating the TSC.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_PIT_H
+#define PIOS_DEV_PIT_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define	IO_PIT		0x040		// PIT counter ports 0x40-0x42
+#define	PIT_MODE	(IO_PIT+3)	// Mode/command register
+#define	PIT_CH2		(IO_PIT+2)	// Channel 2 counter (PC speaker)
+#define	IO_PPI		0x061		// PPI port B: channel 2 gate/output
+
+#define	PIT_FREQ	1193182		// PIT input clock, in Hz
+#define	PIT_CALMS	10		// Milliseconds to calibrate the TSC
+#define	PIT_MAXTSCHZ	10000000000ULL	// Fastest TSC we expect, in Hz
+
+
+// TSC ticks per second, measured by pit_init() (0 if unknown).
+extern uint64_t pit_tschz;
+
+// Calibrate the TSC against the PIT.  Call on the boot CPU only.
+void pit_init(void);
+
+
+#endif	// !PIOS_DEV_PIT_H
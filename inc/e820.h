@@ -0,0 +1,42 @@
+/*
+ * BIOS physical memory map (INT 0x15, AX=0xE820) definitions.
+ * The boot loader collects the map while still in real mode
+ * and leaves it at a fixed physical address for the kernel.
+ */
+
+#ifndef PIOS_INC_E820_H
+#define PIOS_INC_E820_H
+
+// Physical address where boot/boot.S stores the memory map:
+// a 32-bit entry count followed by up to E820_MAX entries.
+// This lies in page 0, which the kernel never allocates.
+#define E820_MAP	0x500
+#define E820_MAX	32		// Max number of entries we collect
+#define E820_ENTSIZE	20		// Size of each entry in bytes
+#define E820_SMAP	0x534D4150	// Signature "SMAP" for the BIOS call
+
+// Address range types
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// Reserved, unusable
+#define E820_ACPI	3		// ACPI tables, reclaimable
+#define E820_NVS	4		// ACPI non-volatile storage
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/cdefs.h>
+
+typedef struct e820entry {
+	uint64_t	addr;		// Start of address range
+	uint64_t	len;		// Length of address range in bytes
+	uint32_t	type;		// Address range type (E820_*)
+} gcc_packed e820entry;
+
+typedef struct e820map {
+	uint32_t	nent;		// Number of valid entries
+	e820entry	ent[E820_MAX];
+} gcc_packed e820map;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !PIOS_INC_E820_H */
@@ -0,0 +1,145 @@
+/*
+ * Kernel statistics returned by the SYS_STAT system call.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_KSTAT_H
+#define PIOS_INC_KSTAT_H
+
+#include <types.h>
+
+
+// Which statistics to read (passed in EDX to SYS_STAT)
+#define STAT_MEM	0x00000000	// Physical page allocator: memstat
+#define STAT_LOCK	0x00000001	// Spinlock contention profile: lockstat
+#define STAT_SCHED	0x00000002	// Process scheduler: schedstat
+#define STAT_TRACE	0x00000003	// Recent scheduler events: schedtrace
+
+
+// Physical page allocator statistics.
+// Counters kept per CPU are summed over all CPUs;
+// since other CPUs keep running while we sum them,
+// the result is only a consistent snapshot on an idle system.
+#define MEMSTAT_NORDERS	16
+
+typedef struct memstat {
+	uint32_t	npage;		// Physical pages, including I/O holes
+	uint32_t	ntotal;		// Pages available to the allocator
+	uint32_t	nfree;		// Pages free in lists, CPU caches and pool
+	uint32_t	ncached;	// Free pages cached by CPUs
+	uint32_t	nzero;		// Free pages in the pre-zeroed pool
+	uint32_t	peakused;	// Most pages allocated from free lists
+	uint32_t	freeblocks[MEMSTAT_NORDERS]; // Free blocks by buddy order
+
+	uint64_t	nalloc;		// Pages allocated
+	uint64_t	nfreed;		// Pages freed
+	uint64_t	allochit;	// mem_alloc()s served from a CPU's cache
+	uint64_t	allocmiss;	// mem_alloc()s that had to refill it
+	uint64_t	freehit;	// mem_free()s absorbed by a CPU's cache
+	uint64_t	freemiss;	// mem_free()s that had to drain it
+	uint64_t	zerohit;	// mem_alloc_zeroed()s served from pool
+	uint64_t	zeromiss;	// mem_alloc_zeroed()s that cleared a page
+	uint64_t	lockcycles;	// Cycles spent acquiring mem_c_lock
+	uint64_t	nlock;		// Number of times mem_c_lock was taken
+} memstat;
+
+
+// Spinlock contention profile, kept only in kernels built with
+// SPINLOCK_PROF=1 (see kern/spinlock.h); otherwise nsite is 0.
+// Counters are per lock initialization site, summed over all locks
+// initialized there, and sites are sorted by total cycles spent spinning.
+#define LOCKSTAT_MAXSITES	16
+#define LOCKSTAT_FILELEN	24
+
+typedef struct lockstat_site {
+	char		file[LOCKSTAT_FILELEN];	// spinlock_init() call site,
+	int		line;			// file name truncated from left
+	uint32_t	nacquire;	// Acquisitions
+	uint32_t	ncontended;	// Acquisitions that had to wait
+	uint64_t	spincycles;	// Total cycles spent waiting
+	uint64_t	spinmax;	// Longest wait
+	uint64_t	holdcycles;	// Total cycles held
+	uint64_t	holdmax;	// Longest hold
+} lockstat_site;
+
+typedef struct lockstat {
+	uint32_t	nsite;		// Number of sites that follow
+	lockstat_site	site[LOCKSTAT_MAXSITES];
+} lockstat;
+
+
+// Process scheduler statistics for each CPU, indexed by CPU number
+// (the boot CPU is 0, the rest numbered in the order they were found),
+// and for up to SCHEDSTAT_MAXPROC processes, in depth-first order
+// starting with the root process.
+// Wakeup latencies, from a process becoming ready after blocking
+// or being started to its running, are counted in a histogram
+// by powers of two microseconds: lat[0] counts latencies under 1us,
+// lat[i] those of at least 2^(i-1)us and under 2^i us,
+// and the last bucket everything longer.
+// Latencies are only measured in kernels built with PROC_TRACE=1
+// (see kern/proctrace.h), as they are by default.
+// Real-time processes (see procsched in inc/syscall.h) count the deadlines
+// they missed, and the periods they used up their budgets and had to wait.
+#define SCHEDSTAT_MAXCPU	32
+#define SCHEDSTAT_MAXPROC	32
+#define SCHEDSTAT_NLAT		16
+
+typedef struct schedstat_cpu {
+	uint32_t	nqueued;	// Processes in this CPU's ready queue
+	uint32_t	nrun;		// Times a process was switched to
+	uint32_t	nmigrate;	// ...that last ran on another CPU
+	uint32_t	ntick;		// Timer ticks taken in user mode
+	uint32_t	rtutil;		// Reserved by real-time processes, ppm
+	uint32_t	rtmiss;		// Deadlines they missed
+	uint32_t	lat[SCHEDSTAT_NLAT];	// Wakeup latencies of those
+} schedstat_cpu;
+
+typedef struct schedstat_proc {
+	uint32_t	id;		// Process's kernel address
+	uint32_t	parent;		// Parent's, or 0 for the root
+	uint32_t	child;		// Its child number in its parent
+	uint32_t	state;		// Scheduling state (see kern/proc.h)
+	uint32_t	nrun;		// Times it was switched to
+	uint32_t	gang;		// Gang it belongs to, 0 if none
+	uint32_t	rtmiss;		// Real-time deadlines missed
+	uint32_t	rtthrottle;	// Real-time periods it ran out of budget
+	uint64_t	runtime;	// TSC cycles spent running
+} schedstat_proc;
+
+typedef struct schedstat {
+	uint64_t	tschz;		// TSC ticks per second, 0 if unknown
+	uint32_t	ncpu;		// Number of CPUs that follow
+	schedstat_cpu	cpu[SCHEDSTAT_MAXCPU];
+	uint32_t	nproc;		// Number of processes that follow
+	schedstat_proc	proc[SCHEDSTAT_MAXPROC];
+} schedstat;
+
+
+// The latest scheduler events traced on each CPU,
+// from kernels built with PROC_TRACE=1 (see kern/proctrace.h).
+#define SCHEDEV_READY	1	// Process woken up or started
+#define SCHEDEV_RUN	2	// Process switched to
+#define SCHEDEV_YIELD	3	// Process preempted
+#define SCHEDEV_WAIT	4	// Process blocked waiting for a child
+#define SCHEDEV_RET	5	// Process returned to its parent
+#define SCHEDEV_MISS	6	// Real-time process missed its deadline
+
+#define SCHEDTRACE_NEVENT	64
+
+typedef struct schedevent {
+	uint64_t	tsc;		// When, by the TSC
+	uint32_t	proc;		// Which process, by kernel address
+	uint32_t	type;		// What happened: SCHEDEV_*
+} schedevent;
+
+typedef struct schedtrace {
+	uint32_t	ncpu;		// Number of CPUs that follow
+	uint32_t	nevent[SCHEDSTAT_MAXCPU];	// Events for each CPU,
+	schedevent	event[SCHEDSTAT_MAXCPU][SCHEDTRACE_NEVENT]; // oldest first
+} schedtrace;
+
+
+#endif /* !PIOS_INC_KSTAT_H */
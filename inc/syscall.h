@@ -19,11 +19,15 @@
 #define SYS_PUT		0x00000001	// Push data to child and start it
 #define SYS_GET		0x00000002	// Pull results from child
 #define SYS_RET		0x00000003	// Return to parent
+#define SYS_STAT	0x00000004	// Read kernel statistics (root only)
+#define SYS_YIELD	0x00000005	// Let other ready processes run first
 
 #define SYS_START	0x00000010	// Put: start child running
+#define SYS_PRINT	0x00000020	// Stat: also dump stats to console
 
 #define SYS_REGS	0x00001000	// Get/put register state
 #define SYS_FPU		0x00002000	// Get/put FPU state (with SYS_REGS)
+#define SYS_SCHED	0x00004000	// Get/put scheduling parameters
 
 
 // Register conventions for CPUTS system call (write to debug console):
@@ -35,19 +39,40 @@
 // Register conventions on GET/PUT system call entry:
 //	EAX:	System call command/flags (SYS_*)
 //	EDX:	bits 7-0: Child process number to get/put
-//	EBX:	Get/put CPU state pointer for SYS_REGS and/or SYS_FPU)
+//	EBX:	Get/put CPU state pointer for SYS_REGS, SYS_FPU and/or SYS_SCHED)
 //	ECX:	Get/put memory region size
 //	ESI:	Get/put local memory region start
 //	EDI:	Get/put child memory region start
 //	EBP:	reserved
 
 
+// Register conventions for STAT system call:
+//	EAX:	System call command/flags (SYS_STAT, optionally SYS_PRINT)
+//	EDX:	Which statistics to read (STAT_* in inc/kstat.h)
+//	EBX:	User pointer to buffer to receive the statistics, or NULL
+
+
 #ifndef __ASSEMBLER__
 
+// Scheduling parameters, for GET/PUT with the SYS_SCHED flag.
+// Zero fields ask for the system defaults.
+// A nonzero period and budget make the process real-time (see kern/proc.h):
+// it gets 'budget' microseconds of CPU time in every 'period', ahead of
+// other processes, if the kernel can guarantee that; if not, PUT leaves
+// both zero, which GET shows, and the process is scheduled as usual.
+typedef struct procsched {
+	uint32_t	quantum;	// Timer tick length in microseconds
+	uint32_t	affinity;	// Bit n set: may run on CPU n; 0 for any
+	uint32_t	gang;		// Co-schedule with siblings of same gang
+	uint32_t	period;		// Real-time period in microseconds
+	uint32_t	budget;		// CPU time needed each period, in us
+} procsched;
+
 // Process state save area format for GET/PUT with SYS_REGS flags
 typedef struct procstate {
 	trapframe	tf;		// general registers
 	uint32_t	pff;		// process feature flags - see below
+	procsched	sched;		// scheduling parameters (SYS_SCHED)
 	fxsave		fx;		// x87/MMX/XMM registers
 } procstate;
 
@@ -109,6 +134,17 @@ sys_get(uint32_t flags, uint16_t child, procstate *save,
 		: "cc", "memory");
 }
 
+static void gcc_inline
+sys_stat(uint32_t flags, uint32_t which, void *buf)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_STAT | flags),
+		  "b" (buf),
+		  "d" (which)
+		: "cc", "memory");
+}
+
 static void gcc_inline
 sys_ret(void)
 {
@@ -117,6 +153,15 @@ sys_ret(void)
 		"a" (SYS_RET));
 }
 
+static void gcc_inline
+sys_yield(void)
+{
+	asm volatile("int %0" : :
+		"i" (T_SYSCALL),
+		"a" (SYS_YIELD)
+		: "cc", "memory");
+}
+
 
 #endif /* !__ASSEMBLER__ */
 
@@ -47,6 +47,12 @@ typedef struct cpuinfo {
 	uint32_t	ecx;
 } cpuinfo;
 
+// Feature flags returned in EDX by CPUID function 1
+#define CPUID_EDX_SSE2	0x04000000	// SSE2, including MOVNTI and SFENCE
+
+// Feature flags returned in ECX by CPUID function 1
+#define CPUID_ECX_TSCDL	0x01000000	// LAPIC timer TSC-deadline mode
+
 
 
 static gcc_inline void
@@ -247,6 +253,13 @@ write_eflags(uint32_t eflags)
         __asm __volatile("pushl %0; popfl" : : "rm" (eflags));
 }
 
+// Write a model-specific register.
+static gcc_inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val) : "memory");
+}
+
 static gcc_inline uint32_t
 read_ebp(void)
 {
@@ -271,6 +284,9 @@ read_cs(void)
         return cs;
 }
 
+// The atomic operations below also act as compiler memory barriers,
+// so that optimized builds don't move memory accesses across them.
+
 // Atomically set *addr to newval and return the old value of *addr.
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
@@ -281,7 +297,7 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	asm volatile("lock; xchgl %0, %1" :
 	       "+m" (*addr), "=a" (result) :
 	       "1" (newval) :
-	       "cc");
+	       "cc", "memory");
 	return result;
 }
 
@@ -289,7 +305,8 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 static inline void
 lockadd(volatile int32_t *addr, int32_t incr)
 {
-	asm volatile("lock; addl %1,%0" : "+m" (*addr) : "r" (incr) : "cc");
+	asm volatile("lock; addl %1,%0" : "+m" (*addr) : "r" (incr)
+			: "cc", "memory");
 }
 
 // Atomically add incr to *addr and return true if the result is zero.
@@ -300,7 +317,7 @@ lockaddz(volatile int32_t *addr, int32_t incr)
 	asm volatile("lock; addl %2,%0; setzb %1"
 		: "+m" (*addr), "=rm" (zero)
 		: "r" (incr)
-		: "cc");
+		: "cc", "memory");
 	return zero;
 }
 
@@ -311,10 +328,24 @@ xadd(volatile uint32_t *addr, int32_t incr)
 	int32_t result;
 
 	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile("lock; xaddl %0, %1" :
+	asm volatile("lock; xaddl %1, %0" :
 	       "+m" (*addr), "=a" (result) :
 	       "1" (incr) :
-	       "cc");
+	       "cc", "memory");
+	return result;
+}
+
+// Atomically set *addr to newval if it equals oldval.
+// Returns the old value of *addr: the swap happened if that is oldval.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0" :
+	       "+m" (*addr), "=a" (result) :
+	       "r" (newval), "1" (oldval) :
+	       "cc", "memory");
 	return result;
 }
 
@@ -333,6 +364,22 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+// Order all preceding stores, including non-temporal ones,
+// before any subsequent stores.
+static gcc_inline void
+sfence(void)
+{
+	asm volatile("sfence" : : : "memory");
+}
+
+// Order all preceding loads and stores before any subsequent ones.
+// Unlike mfence, a locked instruction does this on every x86.
+static gcc_inline void
+membar(void)
+{
+	asm volatile("lock; addl $0,(%%esp)" : : : "cc", "memory");
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
@@ -345,14 +392,23 @@ rdtsc(void)
 static gcc_inline void
 sti(void)
 {
-	asm volatile("sti");
+	asm volatile("sti" : : : "memory");
 }
 
 // Disable external device interrupts.
 static gcc_inline void
 cli(void)
 {
-	asm volatile("cli");
+	asm volatile("cli" : : : "memory");
+}
+
+// Enable interrupts and halt until the next one arrives.
+// No interrupt can slip in between the sti and the hlt,
+// so if interrupts were disabled, one can't be missed.
+static gcc_inline void
+sti_hlt(void)
+{
+	asm volatile("sti; hlt" : : : "memory");
 }
 
 
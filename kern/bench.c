@@ -0,0 +1,37 @@
+/*
+ * Support for in-kernel benchmarks.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mp.h>
+#include <kern/bench.h>
+
+#include <dev/pit.h>
+
+
+void
+bench_barrier(void)
+{
+	static volatile uint32_t count;	// CPUs that have arrived
+	static volatile uint32_t gen;	// Bumped each time all have arrived
+
+	int n = ismp ? ncpu : 1;	// ncpu is 0 without an MP table
+	uint32_t g = gen;
+	if (xadd(&count, 1) == n - 1) {
+		count = 0;
+		xchg(&gen, g + 1);	// let everyone go
+	} else
+		while (gen == g)
+			pause();
+}
+
+uint64_t
+bench_persec(uint64_t n, uint64_t cycles)
+{
+	return cycles ? n * pit_tschz / cycles : 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Support for in-kernel benchmarks.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_BENCH_H
+#define PIOS_KERN_BENCH_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+// Building with 'make BENCH=1' runs the in-kernel benchmarks on all CPUs
+// at boot, after the boot-time self-checks (see misc/bench.sh),
+// and then the process benchmarks in the root process.
+// Each result is one line of the form
+//	<bench>: key=value key=value ...
+// and the root process prints "bench: done" once all benchmarks finish.
+#ifndef PIOS_BENCH
+#define PIOS_BENCH	0
+#endif
+
+
+// Wait until all CPUs have reached the barrier.
+void bench_barrier(void);
+
+// Convert a count of events in a number of TSC cycles into events/second.
+uint64_t bench_persec(uint64_t n, uint64_t cycles);
+
+
+#endif // !PIOS_KERN_BENCH_H
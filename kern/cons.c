@@ -54,7 +54,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
-	spinlock_acquire(&cons_lock);
+	spinlock_acquire_irqsave(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -62,7 +62,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
-	spinlock_release(&cons_lock);
+	spinlock_release_irqrestore(&cons_lock);
 
 }
 
@@ -124,15 +124,16 @@ cputs(const char *str)
 	// so that the output of different cputs calls won't get mixed.
 	// Implement ad hoc recursive locking for debugging convenience.
 	bool already = spinlock_holding(&cons_lock);
+	// Interrupt handlers print too, and cons_intr() takes the lock.
 	if (!already)
-		spinlock_acquire(&cons_lock);
+		spinlock_acquire_irqsave(&cons_lock);
 
 	char ch;
 	while (*str)
 		cons_putc(*str++);
 
 	if (!already)
-		spinlock_release(&cons_lock);
+		spinlock_release_irqrestore(&cons_lock);
 }
 
 
@@ -96,6 +96,7 @@ void cpu_init()
 }
 
 // Allocate an additional cpu struct representing a non-bootstrap processor.
+// Returns NULL if we already have CPU_MAX CPUs.
 cpu *
 cpu_alloc(void)
 {
@@ -103,14 +104,17 @@ cpu_alloc(void)
 	// for chaining on new CPUs in cpu_alloc().  Note: static.
 	static cpu **cpu_tail = &cpu_boot.next;
 
-	pageinfo *pi = mem_alloc();
+	// Index to give the next CPU; the boot CPU is CPU 0.
+	static uint8_t cpu_nextnum = 1;
+	if (cpu_nextnum >= CPU_MAX)
+		return NULL;
+
+	// Clear the whole page for good measure: cpu struct and kernel stack
+	pageinfo *pi = mem_alloc_zeroed();
 	assert(pi != 0);	// shouldn't be out of memory just yet!
 
 	cpu *c = (cpu*) mem_pi2ptr(pi);
 
-	// Clear the whole page for good measure: cpu struct and kernel stack
-	memset(c, 0, PAGESIZE);
-
 	// Now we need to initialize the new cpu struct
 	// just to the same degree that cpu_boot was statically initialized.
 	// The rest will be filled in by the CPU itself
@@ -123,6 +127,7 @@ cpu_alloc(void)
 
 	// Magic verification tag for stack overflow/cpu corruption checking
 	c->magic = CPU_MAGIC;
+	c->num = cpu_nextnum++;
 
 	// Chain the new CPU onto the tail of the list.
 	*cpu_tail = c;
@@ -134,8 +139,8 @@ cpu_alloc(void)
 void
 cpu_bootothers(void)
 {
-	extern uint8_t _binary_obj_boot_bootother_start[],
-			_binary_obj_boot_bootother_size[];
+	extern uint8_t _binary_boot_bootother_start[],
+			_binary_boot_bootother_size[];
 
 	if (!cpu_onboot()) {
 		// Just inform the boot cpu we've booted.
@@ -145,8 +150,8 @@ cpu_bootothers(void)
 
 	// Write bootstrap code to unused memory at 0x1000.
 	uint8_t *code = (uint8_t*)0x1000;
-	memmove(code, _binary_obj_boot_bootother_start,
-		(uint32_t)_binary_obj_boot_bootother_size);
+	memmove(code, _binary_boot_bootother_start,
+		(uint32_t)_binary_boot_bootother_size);
 
 	cpu *c;
 	for(c = &cpu_boot; c; c = c->next){
@@ -32,6 +32,11 @@
 #include <inc/mmu.h>
 #include <inc/trap.h>
 
+#include <kern/debug.h>
+#include <kern/spinlock.h>
+#include <kern/mem.h>
+#include <kern/ready_queue.h>
+
 
 // Per-CPU kernel state structure.
 // Exactly one page (4096 bytes) in size.
@@ -58,12 +63,65 @@ typedef struct cpu {
 	// Local APIC ID of this CPU, for inter-processor interrupts etc.
 	uint8_t		id;
 
+	// Dense index of this CPU (boot CPU is 0), for per-CPU arrays.
+	uint8_t		num;
+
 	// Flag used in cpu.c to serialize bootstrap of all CPUs
 	volatile uint32_t booted;
 
 	// Process currently running on this CPU.
 	struct proc	*proc;
 
+	// Processes ready to run on this CPU (see proc_ready()).
+	ready_queue	runq;
+
+	// Child just started by the process running here, which we switch to
+	// directly if its parent waits for it (see proc_handoff()).
+	struct proc	*volatile runnext;
+
+	// Gang member another CPU wants us to run right away,
+	// and a gang whose member we're running that should stop now
+	// (see proc_gang_launch() and proc_gang_stop()).
+	struct proc	*volatile gangnext;
+	struct proc_gang *volatile gangstop;
+
+	// Times we switched to a process, and how many of those
+	// had last run on another CPU (see proc_mark()).
+	uint32_t	nrun;
+	uint32_t	nmigrate;
+
+	// Share of our time reserved by the real-time processes bound to us,
+	// in millionths, and the deadlines they missed (see proc_setrt()).
+	uint32_t	rtutil;
+	uint32_t	rtmiss;
+
+	// LAPIC timer ticks this CPU has taken in user mode (see proc_tick()),
+	// and the length they are set to in microseconds (see lapic_settick()),
+	// or 0 while ticks are off.
+	uint32_t	ticks;
+	uint32_t	tickus;
+
+	// Set when a reschedule IPI interrupted the kernel (see do_resched()),
+	// until a timer tick in user mode acts on it (see proc_tick()).
+	volatile bool	resched;
+
+	// Nonzero while halted in proc_sched() with nothing to run,
+	// until another CPU claims us to wake up with an IPI.
+	volatile uint32_t idle;
+
+	// This CPU's private cache of free physical pages (see kern/mem.h).
+	mem_pcpu	mem;
+
+	// Queue nodes for the MCS locks this CPU holds or waits for,
+	// and a bitmask of which ones are in use (see kern/spinlock.h).
+	spinlock_mcsnode mcsnode[SPINLOCK_MCSNODES];
+	uint8_t		mcsused;
+
+	// Nesting depth of cpu_cli() calls (see below), and whether
+	// interrupts were enabled before the outermost one.
+	int		ncli;
+	bool		intena;
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
@@ -77,6 +135,8 @@ typedef struct cpu {
 
 #define CPU_MAGIC	0x98765432	// cpu.magic should always = this
 
+#define CPU_MAX		32		// Max # of CPUs we support
+
 
 // We have one statically-allocated cpu struct representing the boot CPU;
 // others get chained onto this via cpu_boot.next as we find them.
@@ -89,10 +149,35 @@ extern cpu cpu_boot;
 static inline cpu *
 cpu_cur() {
 	cpu *c = (cpu*)ROUNDDOWN(read_esp(), PAGESIZE);
-	assert(c->magic == CPU_MAGIC);
+	debug_assert(c->magic == CPU_MAGIC);
 	return c;
 }
 
+// Disable interrupts on this CPU, counting how deeply we've nested.
+// Interrupts stay disabled until each cpu_cli() is matched by a cpu_sti(),
+// and the last cpu_sti() re-enables them only if the first cpu_cli()
+// found them enabled.  Use these instead of cli() and sti()
+// wherever a critical section might be entered with interrupts disabled.
+static inline void
+cpu_cli(void)
+{
+	uint32_t eflags = read_eflags();
+	cli();
+	cpu *c = cpu_cur();
+	if (c->ncli++ == 0)
+		c->intena = (eflags & FL_IF) != 0;
+}
+
+static inline void
+cpu_sti(void)
+{
+	cpu *c = cpu_cur();
+	debug_assert(!(read_eflags() & FL_IF));
+	debug_assert(c->ncli > 0);
+	if (--c->ncli == 0 && c->intena)
+		sti();
+}
+
 // Returns true if we're running on the bootstrap CPU.
 static inline int
 cpu_onboot() {
@@ -108,6 +193,7 @@ void cpu_init(void);
 
 // Allocate an additional cpu struct representing a non-bootstrap processor,
 // and chain it onto the list of all CPUs.
+// Returns NULL if there are already CPU_MAX CPUs.
 cpu *cpu_alloc(void);
 
 // Get any additional processors booted up and running.
@@ -15,11 +15,30 @@
 
 #include <inc/types.h>
 #include <inc/cdefs.h>
+#include <inc/assert.h>
 
 
 #define DEBUG_TRACEFRAMES	10
 
 
+// Debugging level, normally set via PIOS_DEBUG in conf/env.mk
+// or on the make command line (see GNUmakefile):
+//	0	release build: no debug bookkeeping on hot paths
+//	1	debug build: assertions on hot paths, long spinlock hold warnings
+//	2	as 1, plus more expensive checks such as poisoning freed pages
+//		and recording full call stacks in spinlocks
+#ifndef PIOS_DEBUG
+#define PIOS_DEBUG	1
+#endif
+
+// Assertion on a hot path, compiled out of release builds.
+#if PIOS_DEBUG >= 1
+#define debug_assert(x)		assert(x)
+#else
+#define debug_assert(x)		do { } while (0)
+#endif
+
+
 void debug_warn(const char*, int, const char*, ...);
 void debug_panic(const char*, int, const char*, ...) gcc_noreturn;
 void debug_trace(uint32_t ebp, uint32_t eips[DEBUG_TRACEFRAMES]);
@@ -12,26 +12,32 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/cdefs.h>
+#include <inc/syscall.h>
+#include <inc/kstat.h>
 
 #include <kern/init.h>
 #include <kern/cons.h>
 #include <kern/debug.h>
 #include <kern/mem.h>
+#include <kern/kmem.h>
 #include <kern/cpu.h>
 #include <kern/trap.h>
 #include <kern/spinlock.h>
+#include <kern/rwlock.h>
 #include <kern/mp.h>
 #include <kern/proc.h>
+#include <kern/bench.h>
 
 #include <dev/pic.h>
 #include <dev/lapic.h>
 #include <dev/ioapic.h>
+#include <dev/pit.h>
 
 
 // User-mode stack for user(), below, to run on.
 static char gcc_aligned(16) user_stack[PAGESIZE];
 
-#define ROOTEXE_START _binary_obj_user_sh_start
+#define ROOTEXE_START _binary_user_sh_start
 
 // Lab 3: ELF executable containing root process, linked into the kernel
 #ifndef ROOTEXE_START
@@ -64,21 +70,45 @@ init(void)
 	// Physical memory detection/initialization.
 	// Can't call mem_alloc until after we do this!
 	mem_init();
+	kmem_init();
 
 	// Lab 2: check spinlock implementation
-	if (cpu_onboot())
+	if (cpu_onboot()) {
 		spinlock_check();
+		rwlock_check();
+	}
+
+	// Check the kernel object allocator.
+	if (cpu_onboot())
+		kmem_check();
 
 	// Find and start other processors in a multiprocessor system
 	mp_init();		// Find info about processors in system
 	pic_init();		// setup the legacy PIC (mainly to disable it)
 	ioapic_init();		// prepare to handle external device interrupts
-	lapic_init();		// setup this CPU's local APIC
+	pit_init();		// calibrate the TSC
+	lapic_init();		// setup this CPU's local APIC and its timer
+
+	// From here on the kernel takes interrupts except in critical
+	// sections (see cpu_cli() in kern/cpu.h): the LAPIC is set up
+	// to handle them and the legacy PIC is out of the way.
+	sti();
 	proc_init();
 	cpu_bootothers();	// Get other processors started
 	cprintf("CPU %d (%s) has booted\n", cpu_cur()->id,
 		cpu_onboot() ? "BP" : "AP");
 
+	// Finish building the physical page free lists, using all CPUs.
+	mem_init_parallel();
+
+	// Run the in-kernel benchmarks if this is a benchmarking build.
+	// The process benchmarks run later, in the root process.
+	if (PIOS_BENCH) {
+		mem_bench();
+		spinlock_bench();
+		bench_barrier();
+	}
+
 	// Initialize the process management code.
 	//proc_init();
 
@@ -87,20 +117,22 @@ init(void)
 	// instead of just calling user() directly.
 	//user();
 
-	uint32_t *esp = (uint32_t*) &user_stack[PAGESIZE];
-	proc_root->sv.tf.esp = (uint32_t) esp;
-	proc_root->sv.tf.eip = (uint32_t) user;
-	proc_root->sv.tf.cs = (uint32_t) CPU_GDT_UCODE+3;
-	proc_root->sv.tf.ss = (uint32_t) CPU_GDT_UDATA+3;
-
-	proc_root->sv.tf.ds = (uint32_t) CPU_GDT_UDATA+3;
-	proc_root->sv.tf.es = (uint32_t) CPU_GDT_UDATA+3;
-	proc_root->sv.tf.fs = (uint32_t) CPU_GDT_UDATA+3;
-	proc_root->sv.tf.gs = (uint32_t) CPU_GDT_UDATA+3;
-
-
-
-	proc_ready(proc_root);
+	// Only the boot CPU sets up and readies the root process:
+	// readying it once per CPU would put it on the ready queue repeatedly.
+	if (cpu_onboot()) {
+		uint32_t *esp = (uint32_t*) &user_stack[PAGESIZE];
+		proc_root->sv.tf.esp = (uint32_t) esp;
+		proc_root->sv.tf.eip = (uint32_t) user;
+		proc_root->sv.tf.cs = (uint32_t) CPU_GDT_UCODE+3;
+		proc_root->sv.tf.ss = (uint32_t) CPU_GDT_UDATA+3;
+
+		proc_root->sv.tf.ds = (uint32_t) CPU_GDT_UDATA+3;
+		proc_root->sv.tf.es = (uint32_t) CPU_GDT_UDATA+3;
+		proc_root->sv.tf.fs = (uint32_t) CPU_GDT_UDATA+3;
+		proc_root->sv.tf.gs = (uint32_t) CPU_GDT_UDATA+3;
+
+		proc_ready(proc_root);
+	}
 	proc_sched();
 	//proc_run(proc_root);
 }
@@ -120,6 +152,19 @@ user()
 	// Check the system call and process scheduling code.
 	proc_check();
 
+	// Time process switching if this is a benchmarking build.
+	if (PIOS_BENCH) {
+		proc_bench();
+		cprintf("bench: done\n");
+	}
+
+	// Show how the page allocator held up, where processes ran,
+	// and which locks we fought over.
+	sys_stat(SYS_PRINT, STAT_MEM, NULL);
+	sys_stat(SYS_PRINT, STAT_SCHED, NULL);
+	if (SPINLOCK_PROF)
+		sys_stat(SYS_PRINT, STAT_LOCK, NULL);
+
 	done();
 }
 
@@ -0,0 +1,342 @@
+/*
+ * Slab allocator for kernel objects smaller than a page.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+
+#include <kern/mem.h>
+#include <kern/cpu.h>
+#include <kern/kmem.h>
+
+
+#define KMEM_NCLASSES	7	// KMEM_MINSIZE << (KMEM_NCLASSES-1) = MAXSIZE
+
+static kmem_cache kmem_class[KMEM_NCLASSES];
+static const char *kmem_classname[KMEM_NCLASSES] = {
+	"kmem-16", "kmem-32", "kmem-64", "kmem-128",
+	"kmem-256", "kmem-512", "kmem-1024",
+};
+
+#define slab(obj)	((kmem_slab*)ROUNDDOWN((uint32_t)(obj), PAGESIZE))
+#define slabobj(c,s,i)	((void*)((char*)(s) + (c)->objoff + (i)*(c)->size))
+#define slabidx(c,s,o)	(((char*)(o) - (char*)(s) - (c)->objoff) / (c)->size)
+
+
+void
+kmem_init(void)
+{
+	if (!cpu_onboot())	// only do once, on the boot CPU
+		return;
+
+	int i;
+	for (i = 0; i < KMEM_NCLASSES; i++)
+		kmem_cache_init(&kmem_class[i], kmem_classname[i],
+				KMEM_MINSIZE << i, 0, NULL);
+	assert(kmem_class[KMEM_NCLASSES-1].size == KMEM_MAXSIZE);
+}
+
+void
+kmem_cache_init(kmem_cache *c, const char *name, size_t size,
+		size_t align, void (*ctor)(void *obj))
+{
+	if (align == 0)
+		align = sizeof(void*);
+	assert((align & (align - 1)) == 0);
+
+	memset(c, 0, sizeof(*c));
+	spinlock_init(&c->lock);
+	c->name = name;
+	c->size = ROUNDUP(size, align);
+	c->ctor = ctor;
+
+	// Fit as many objects as we can after the header and index array.
+	int n = (PAGESIZE - sizeof(kmem_slab)) / (c->size + sizeof(uint16_t));
+	while (n > 0 && ROUNDUP(sizeof(kmem_slab) + n * sizeof(uint16_t), align)
+			+ n * c->size > PAGESIZE)
+		n--;
+	if (n == 0)
+		panic("kmem_cache_init: %s: %d-byte objects too big for a slab",
+			name, (int)size);
+	c->perslab = n;
+	c->objoff = ROUNDUP(sizeof(kmem_slab) + n * sizeof(uint16_t), align);
+}
+
+// Push a slab onto a cache's partial or empty list.
+static void
+kmem_slab_push(kmem_slab **list, kmem_slab *s)
+{
+	s->prev = list;
+	s->next = *list;
+	if (s->next)
+		s->next->prev = &s->next;
+	*list = s;
+}
+
+// Unlink a slab from whichever list it is on.
+static void
+kmem_slab_remove(kmem_slab *s)
+{
+	*s->prev = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->next = NULL;
+	s->prev = NULL;
+}
+
+// Get a fresh page from the page allocator and turn it into a slab
+// whose objects are all constructed and free.
+// Called without the cache's lock held.
+static kmem_slab *
+kmem_slab_create(kmem_cache *c)
+{
+	pageinfo *pi = mem_alloc_zeroed();
+	if (pi == NULL)
+		return NULL;
+	mem_incref(pi);
+
+	kmem_slab *s = mem_pi2ptr(pi);
+	s->cache = c;
+	s->nfree = c->perslab;
+	int i;
+	for (i = 0; i < c->perslab; i++) {
+		s->freeidx[i] = c->perslab - 1 - i;	// hand out in order
+		if (c->ctor)
+			c->ctor(slabobj(c, s, i));
+	}
+	return s;
+}
+
+// Move up to KMEM_PCPU_BATCH objects from the slabs into a CPU's cache,
+// creating new slabs as necessary.
+static void
+kmem_refill(kmem_cache *c, kmem_pcpu *pc)
+{
+	spinlock_acquire(&c->lock);
+	while (pc->nobj < KMEM_PCPU_BATCH) {
+		kmem_slab *s = c->partial;
+		if (s == NULL && c->empty != NULL) {
+			s = c->empty;
+			kmem_slab_remove(s);
+			kmem_slab_push(&c->partial, s);
+			c->nempty--;
+		}
+		if (s == NULL) {
+			// Don't hold the cache lock while in the page allocator.
+			spinlock_release(&c->lock);
+			s = kmem_slab_create(c);
+			spinlock_acquire(&c->lock);
+			if (s == NULL)
+				break;
+			kmem_slab_push(&c->partial, s);
+			c->nslab++;
+		}
+
+		pc->obj[pc->nobj++] = slabobj(c, s, s->freeidx[--s->nfree]);
+		s->ninuse++;
+		if (s->nfree == 0)	// full slabs aren't on any list
+			kmem_slab_remove(s);
+	}
+	spinlock_release(&c->lock);
+}
+
+// Return the 'n' coldest objects in a CPU's cache to their slabs,
+// then give surplus empty slabs back to the page allocator.
+// If 'keep' is false, give back all empty slabs.
+static void
+kmem_pcpu_drain(kmem_cache *c, kmem_pcpu *pc, int n, bool keep)
+{
+	kmem_slab *release = NULL;
+	int i;
+
+	spinlock_acquire(&c->lock);
+	for (i = 0; i < n; i++) {
+		void *obj = pc->obj[i];
+		kmem_slab *s = slab(obj);
+		assert(s->cache == c && s->ninuse > 0);
+		int idx = slabidx(c, s, obj);
+#if PIOS_DEBUG >= 2
+		int j;
+		for (j = 0; j < s->nfree; j++)
+			assert(s->freeidx[j] != idx);	// catch double frees
+#endif
+		if (s->nfree == 0)	// was full
+			kmem_slab_push(&c->partial, s);
+		s->freeidx[s->nfree++] = idx;
+		if (--s->ninuse == 0) {
+			kmem_slab_remove(s);
+			kmem_slab_push(&c->empty, s);
+			c->nempty++;
+		}
+	}
+	while (c->nempty > (keep ? KMEM_EMPTYMAX : 0)) {
+		kmem_slab *s = c->empty;
+		kmem_slab_remove(s);
+		c->nempty--;
+		c->nslab--;
+		s->next = release;
+		release = s;
+	}
+	spinlock_release(&c->lock);
+
+	pc->nobj -= n;
+	memmove(&pc->obj[0], &pc->obj[n], pc->nobj * sizeof(pc->obj[0]));
+
+	// Free the pages without holding the cache lock.
+	while (release != NULL) {
+		kmem_slab *s = release;
+		release = s->next;
+		mem_decref(mem_ptr2pi(s), mem_free);
+	}
+}
+
+void *
+kmem_cache_alloc(kmem_cache *c)
+{
+	kmem_pcpu *pc = &c->cpu[cpu_cur()->num];
+	if (pc->nobj == 0) {
+		kmem_refill(c, pc);
+		if (pc->nobj == 0)
+			return NULL;
+	}
+	return pc->obj[--pc->nobj];
+}
+
+void
+kmem_cache_free(kmem_cache *c, void *obj)
+{
+	debug_assert(slab(obj)->cache == c);
+
+	kmem_pcpu *pc = &c->cpu[cpu_cur()->num];
+#if PIOS_DEBUG >= 2
+	int i;
+	for (i = 0; i < pc->nobj; i++)
+		assert(pc->obj[i] != obj);	// catch double frees
+#endif
+	if (pc->nobj == KMEM_PCPU_MAX)
+		kmem_pcpu_drain(c, pc, KMEM_PCPU_BATCH, true);
+	pc->obj[pc->nobj++] = obj;
+}
+
+void
+kmem_cache_drain(kmem_cache *c)
+{
+	kmem_pcpu *pc = &c->cpu[cpu_cur()->num];
+	kmem_pcpu_drain(c, pc, pc->nobj, false);
+}
+
+void
+kmem_cache_destroy(kmem_cache *c)
+{
+	int i;
+	for (i = 0; i < CPU_MAX; i++)
+		kmem_pcpu_drain(c, &c->cpu[i], c->cpu[i].nobj, false);
+	if (c->nslab != 0)
+		panic("kmem_cache_destroy: %s: objects still allocated",
+			c->name);
+}
+
+void *
+kmem_alloc(size_t size)
+{
+	int i;
+	for (i = 0; i < KMEM_NCLASSES; i++)
+		if (size <= kmem_class[i].size)
+			return kmem_cache_alloc(&kmem_class[i]);
+	return NULL;
+}
+
+void
+kmem_free(void *ptr)
+{
+	kmem_cache_free(slab(ptr)->cache, ptr);
+}
+
+
+#define KMEM_CHECK_MAGIC	0xdeadbeef
+
+static int kmem_check_nctor;
+
+static void
+kmem_check_ctor(void *obj)
+{
+	uint32_t *o = obj;
+	o[0] = KMEM_CHECK_MAGIC;
+	kmem_check_nctor++;
+}
+
+//
+// Check the object allocator for correct operation.
+// Objects are chained through their second word, o[1],
+// and marked allocated in their third word, o[2].
+//
+void
+kmem_check(void)
+{
+	static kmem_cache c;
+	uint32_t *o, *ol;
+	int i, n;
+
+	kmem_cache_init(&c, "kmem_check", 40, 8, kmem_check_ctor);
+	assert(c.size == 40 && c.perslab > 1);
+	assert(c.objoff + c.perslab * c.size <= PAGESIZE);
+
+	// Allocate enough objects to need several slabs.
+	int nobj = 3 * c.perslab + 5;
+	ol = NULL;
+	for (i = 0; i < nobj; i++) {
+		o = kmem_cache_alloc(&c);
+		assert(o != NULL);
+		assert(((uint32_t)o & 7) == 0);
+		assert(o[0] == KMEM_CHECK_MAGIC);	// constructed
+		assert(o[1] == 0 && o[2] == 0);		// zero, not in use
+		assert(slab(o)->cache == &c);
+		o[1] = (uint32_t)ol;
+		o[2] = 1;
+		ol = o;
+	}
+	assert(c.nslab == 4);
+	assert(kmem_check_nctor == c.nslab * c.perslab);
+
+	// Give them all back in their constructed state.
+	while (ol != NULL) {
+		o = ol;
+		ol = (uint32_t*)o[1];
+		o[1] = o[2] = 0;
+		kmem_cache_free(&c, o);
+	}
+	kmem_cache_drain(&c);
+	assert(c.nslab == 0 && c.partial == NULL && c.empty == NULL);
+
+	// A new slab's objects get constructed again.
+	n = kmem_check_nctor;
+	o = kmem_cache_alloc(&c);
+	assert(o != NULL && o[0] == KMEM_CHECK_MAGIC);
+	assert(kmem_check_nctor == n + c.perslab);
+	kmem_cache_free(&c, o);
+	kmem_cache_destroy(&c);
+	assert(c.nslab == 0);
+
+	// Check the size classes.
+	static const size_t sizes[] = { 1, 16, 17, 100, 1000, 1024 };
+	void *p[sizeof(sizes)/sizeof(sizes[0])];
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		p[i] = kmem_alloc(sizes[i]);
+		assert(p[i] != NULL);
+		kmem_cache *kc = slab(p[i])->cache;
+		assert(kc->size >= sizes[i] && kc->size < 2 * sizes[i] + 16);
+		memset(p[i], i, sizes[i]);
+	}
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		uint8_t *b = p[i];
+		assert(b[0] == i && b[sizes[i]-1] == i);
+		kmem_free(p[i]);
+	}
+	assert(kmem_alloc(KMEM_MAXSIZE + 1) == NULL);
+
+	cprintf("kmem_check() succeeded!\n");
+}
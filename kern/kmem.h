@@ -0,0 +1,116 @@
+/*
+ * Kernel object allocator definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_KMEM_H
+#define PIOS_KERN_KMEM_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+
+
+// A kmem_cache hands out fixed-size objects packed into one-page slabs,
+// which it gets from mem_alloc() and gives back when they become empty.
+// Objects are kept in their constructed state while free:
+// the constructor runs once on each object when its slab is created,
+// and kmem_cache_free() expects the object back in the same state.
+// Objects in a new slab are all zero before the constructor runs.
+//
+// Each CPU keeps a small cache of free objects for each kmem_cache,
+// refilled from and drained to the slabs in batches under the cache's lock,
+// so most allocations and frees touch neither that lock nor mem_c_lock.
+// As with the page allocator's per-CPU caches (see kern/mem.h),
+// only the owning CPU touches its cache, without a lock: interrupt handlers
+// must not allocate or free objects, since they could interrupt that CPU
+// in the middle of changing it.
+#define KMEM_PCPU_MAX	16	// Maximum number of objects in a CPU's cache
+#define KMEM_PCPU_BATCH	8	// Objects moved to/from the slabs at once
+#define KMEM_EMPTYMAX	1	// Empty slabs a cache keeps for reuse
+
+typedef struct kmem_pcpu {
+	int		nobj;			// Number of cached objects
+	void		*obj[KMEM_PCPU_MAX];	// Cached objects, hottest last
+} kmem_pcpu;
+
+typedef struct kmem_cache {
+	spinlock	lock;		// Protects the slab lists and counts
+	const char	*name;		// For debugging
+	size_t		size;		// Object size, rounded up to alignment
+	size_t		objoff;		// Offset of first object in a slab
+	int		perslab;	// Number of objects per slab
+	void		(*ctor)(void *obj);	// Constructor, or NULL
+
+	struct kmem_slab *partial;	// Slabs with some objects allocated
+	struct kmem_slab *empty;	// Slabs with no objects allocated
+	int		nempty;		// Number of slabs on the empty list
+	int		nslab;		// Total number of slabs (pages) held
+
+	kmem_pcpu	cpu[CPU_MAX];	// Per-CPU caches, indexed by cpu.num
+} kmem_cache;
+
+// Header at the start of each slab page, followed by an array of indexes
+// of the slab's free objects, then the objects themselves.
+// Free objects are tracked outside the objects so as not to disturb
+// their constructed state.
+typedef struct kmem_slab {
+	struct kmem_slab *next;		// Next slab on partial or empty list
+	struct kmem_slab **prev;	// Pointer that points to us on the list
+	kmem_cache	*cache;		// Cache this slab belongs to
+	uint16_t	ninuse;		// Objects allocated, incl. in CPU caches
+	uint16_t	nfree;		// Number of entries in freeidx
+	uint16_t	freeidx[0];	// Indexes of free objects
+} kmem_slab;
+
+
+// kmem_alloc() serves sizes up to KMEM_MAXSIZE from power-of-two
+// size classes of at least KMEM_MINSIZE bytes.
+// Larger objects would waste too much of a slab page on its header:
+// allocate whole pages for those, or give them a cache of their own.
+#define KMEM_MINSIZE	16
+#define KMEM_MAXSIZE	1024
+
+
+// Initialize the allocator's size classes.
+void kmem_init(void);
+
+// Initialize a cache of objects of the given size and alignment
+// (a power of two, or 0 for the default of sizeof(void*)).
+// The optional constructor is applied to each object in a new slab.
+void kmem_cache_init(kmem_cache *c, const char *name, size_t size,
+			size_t align, void (*ctor)(void *obj));
+
+// Allocate an object from a cache, or return NULL if out of memory.
+void *kmem_cache_alloc(kmem_cache *c);
+
+// Return an object, in its constructed state, to the cache it came from.
+void kmem_cache_free(kmem_cache *c, void *obj);
+
+// Return this CPU's cached objects to their slabs,
+// and give back all empty slabs to the page allocator.
+void kmem_cache_drain(kmem_cache *c);
+
+// Release all of a cache's memory.
+// Every object must already have been freed,
+// and no other CPU may be using the cache.
+void kmem_cache_destroy(kmem_cache *c);
+
+// Allocate at least 'size' bytes from the appropriate size class,
+// or return NULL if size is over KMEM_MAXSIZE or we are out of memory.
+void *kmem_alloc(size_t size);
+
+// Free memory from kmem_alloc().
+void kmem_free(void *ptr);
+
+// Check the object allocator.
+void kmem_check(void);
+
+
+#endif // !PIOS_KERN_KMEM_H
@@ -18,17 +18,35 @@
 #include <dev/lapic.h>
 
 
-static unsigned n = 0;
-
 static void
 do_ltimer(trapframe *tf)
 {
-	if ((n % 25) == 0 || (n % 25) == 1) {
-		//cprintf("do_ltimer=%d cpu=%d\n", n, cpu_cur()->id);
-	}
-	n++;
 	lapic_eoi();		//clear interrupt
-	proc_yield(tf);
+	lapic_nexttick();	//one-shot: set it going again
+
+	// The kernel can't be switched away from in mid-operation:
+	// just resume it, and preempt the process at a later tick.
+	if (!(tf->cs & 3))
+		trap_return(tf);
+	proc_tick(tf);
+}
+
+
+// Another CPU made a process ready for us (see proc_enqueue()).
+// If we're running a process, yield if there's a more urgent one.
+// If we interrupted the kernel, which may be halted in proc_sched()
+// or hold our ready queue's lock, don't look at the queues from here:
+// just note it and tick soon, and the first tick back in user mode
+// yields instead of counting as a tick (see proc_tick()).
+static void
+do_resched(trapframe *tf)
+{
+	lapic_eoi();
+	if (tf->cs & 3)
+		proc_yield(tf);
+	cpu_cur()->resched = true;
+	lapic_settick(LAPIC_TICK_MIN);
+	trap_return(tf);
 }
 
 
@@ -49,6 +67,7 @@ local_apic(trapframe *tf)
 	switch (tf->trapno) {
 	case T_LTIMER:	return do_ltimer(tf);
 	case T_IRQ0+IRQ_SPURIOUS:	return do_spurious(tf);
+	case T_RESCHED:	return do_resched(tf);
 	default:	return;		// handle as a regular trap
 	}
 }
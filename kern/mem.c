@@ -16,20 +16,67 @@
 #include <kern/cpu.h>
 #include <kern/mem.h>
 #include <kern/spinlock.h>
+#include <kern/bench.h>
+#include <kern/mp.h>
 
 #include <dev/nvram.h>
 
+#include <inc/e820.h>
+
 
 size_t mem_max;			// Maximum physical address
 size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
-pageinfo *mem_freelist;		// Start of free page list
-spinlock mem_c_lock;		// protect mem_freelist
-
-#define ONE_GB (1024*1024*1024)
+pageinfo *mem_freelist[MEM_NORDERS];	// Free buddy blocks of each order
+size_t mem_nfree;		// Number of pages on all the free lists
+spinlock mem_c_lock;		// protect mem_freelist and mem_nfree
+
+static size_t mem_kernend;	// First page after kernel and pageinfo array
+
+// Usable RAM, as page number ranges [lo,hi), found by mem_init().
+static struct { size_t lo, hi; } mem_ram[E820_MAX];
+static int mem_nram;
+
+// Memory not initialized during mem_init() is divided into chunks
+// of MEM_CHUNK pages starting at page mem_chunkbase.
+static size_t mem_chunkbase;
+static uint32_t mem_nchunk;		// Total number of deferred chunks
+static volatile uint32_t mem_chunknext;	// Next chunk to be claimed
+static volatile uint32_t mem_chunkdone;	// Number of chunks finished
+static volatile uint32_t mem_ready;	// Set once mem_check() has passed
+static uint64_t mem_inittsc;		// Timestamp at start of mem_init()
+
+// Pool of pre-zeroed pages, chained through free_next and
+// protected by mem_c_lock like the free lists.
+static pageinfo *mem_zerolist;
+static volatile int mem_nzero;		// Number of pages in the pool
+static bool mem_zero_nt;		// Clear pages with non-temporal stores
+static uint32_t mem_zerohit, mem_zeromiss;
+
+// Allocator accounting, also protected by mem_c_lock.
+// Pages in CPU caches and the zero pool count as allocated here.
+static size_t mem_ntotal;		// Pages ever put on the free lists
+static size_t mem_peakused;		// Max of mem_ntotal - mem_nfree
+
+#define page(addr)	((addr)/PAGESIZE)
+
+// Acquire mem_c_lock, charging the time it takes to this CPU.
+static void
+mem_lock(void)
+{
+	mem_pcpu *pc = &cpu_cur()->mem;
+	uint64_t t = rdtsc();
+	spinlock_acquire(&mem_c_lock);
+	pc->lockcycles += rdtsc() - t;
+	pc->nlock++;
+}
 
 void mem_check(void);
+static bool mem_e820_range(e820entry *e, uint32_t *lo, uint32_t *hi);
+static void mem_init_pages(size_t lo, size_t hi);
+static pageinfo *mem_zero_take(void);
+static void mem_pcpu_drain(mem_pcpu *pc, int n);
 
 void
 mem_init(void)
@@ -37,6 +84,13 @@ mem_init(void)
 	if (!cpu_onboot())	// only do once, on the boot CPU
 		return;
 
+	mem_inittsc = rdtsc();
+	spinlock_init_mcs(&mem_c_lock);
+
+	cpuinfo inf;
+	cpuid(1, &inf);
+	mem_zero_nt = (inf.edx & CPUID_EDX_SSE2) != 0;
+
 	// Determine how much base (<640K) and extended (>1MB) memory
 	// is available in the system (in bytes),
 	// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
@@ -46,90 +100,271 @@ mem_init(void)
 	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
 	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
 
-	warn("Assuming we have 1GB of memory!");
-	extmem = ONE_GB - MEM_EXT;	// assume 1GB total memory
-
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+	// That other way is the BIOS's E820 memory map,
+	// which boot/boot.S collected for us before leaving real mode.
+	// It describes all RAM, including any above 64MB, and the holes in it.
+	// We use the NVRAM sizes only if the BIOS didn't give us a map.
+	e820map *map = mem_ptr(E820_MAP);
+	if (map->nent > E820_MAX)
+		map->nent = 0;		// garbage: don't trust it
+	int i;
+	mem_max = 0;
+	for (i = 0; i < map->nent; i++) {
+		e820entry *e = &map->ent[i];
+		cprintf("e820: 0x%08llx-0x%08llx type %d\n",
+			e->addr, e->addr + e->len - 1, e->type);
+		uint32_t lo, hi;
+		if (e->type != E820_RAM || !mem_e820_range(e, &lo, &hi))
+			continue;
+		mem_ram[mem_nram].lo = page(lo);
+		mem_ram[mem_nram].hi = page(hi);
+		mem_nram++;
+		mem_max = MAX(mem_max, hi);
+	}
+	if (mem_nram == 0) {
+		warn("No BIOS memory map: using NVRAM memory sizes");
+		mem_max = MEM_EXT + extmem;
+		mem_ram[0].lo = 0;
+		mem_ram[0].hi = page(basemem);
+		mem_ram[1].lo = page(MEM_EXT);
+		mem_ram[1].hi = page(mem_max);
+		mem_nram = 2;
+	}
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
-	cprintf("mem_npage=0x%08x\n", mem_npage);	//gch
-
 
 	cprintf("Physical memory: %dK available, ", (int)(mem_max/1024));
 	cprintf("base = %dK, extended = %dK\n",
 		(int)(basemem/1024), (int)(extmem/1024));
 
+	// Place the pageinfo array right after the kernel's own BSS,
+	// just big enough to hold mem_npage entries,
+	// and reserve it along with the kernel itself.
+	mem_pageinfo = mem_ptr(ROUNDUP(mem_phys(end), PAGESIZE));
+	mem_kernend = page(ROUNDUP(mem_phys(&mem_pageinfo[mem_npage]),
+				PAGESIZE));
+
+	cprintf("pageinfo=0x%08x-0x%08x  start=0x%08x  end=0x%08x\n",
+		mem_pageinfo, &mem_pageinfo[mem_npage], start, end);
+
+	// Build the free lists right away only for the memory we need to boot:
+	// everything up to the end of the pageinfo array plus one more chunk.
+	// The rest gets built later in parallel by mem_init_parallel().
+	size_t bootend = mem_npage;
+	if (MEM_DEFERINIT)
+		bootend = MIN(ROUNDUP(mem_kernend, MEM_CHUNK) + MEM_CHUNK,
+				mem_npage);
+	mem_init_pages(0, bootend);
+
+	mem_chunkbase = bootend;
+	mem_nchunk = ROUNDUP(mem_npage - bootend, MEM_CHUNK) / MEM_CHUNK;
+}
+
+// Claim and initialize the next deferred chunk of physical memory.
+// Returns false if there are no chunks left to initialize.
+// If other CPUs are still busy initializing the last chunks,
+// waits for them to finish and returns true,
+// so that callers looking for free memory can try again.
+static bool
+mem_grow(void)
+{
+	if (mem_chunknext < mem_nchunk) {
+		uint32_t c = xadd(&mem_chunknext, 1);
+		if (c < mem_nchunk) {
+			size_t lo = mem_chunkbase + c * MEM_CHUNK;
+			mem_init_pages(lo, MIN(lo + MEM_CHUNK, mem_npage));
+			xadd(&mem_chunkdone, 1);
+			return true;
+		}
+	}
+	if (mem_chunkdone == mem_nchunk)
+		return false;
+	while (mem_chunkdone < mem_nchunk)
+		pause();
+	return true;
+}
 
-	// Insert code here to:
-	// (1)	allocate physical memory for the mem_pageinfo array,
-	//	making it big enough to hold mem_npage entries.
-	// (2)	add all pageinfo structs in the array representing
-	//	available memory that is not in use for other purposes.
-	//
-	// For step (2), here is some incomplete/incorrect example code
-	// that simply marks all mem_npage pages as free.
-	// Which memory is actually free?
-	//  1) Reserve page 0 for the real-mode IDT and BIOS structures
-	//     (do not allow this page to be used for anything else).
-	//  2) Reserve page 1 for the AP bootstrap code (boot/bootother.S).
-	//  3) Mark the rest of base memory as free.
-	//  4) Then comes the IO hole [MEM_IO, MEM_EXT).
-	//     Mark it as in-use so that it can never be allocated.      
-	//  5) Then extended memory [MEM_EXT, ...).
-	//     Some of it is in use, some is free.
-	//     Which pages hold the kernel and the pageinfo array?
-	//     Hint: the linker places the kernel (see start and end above),
-	//     but YOU decide where to place the pageinfo array.
-	// Change the code to reflect this.
+void
+mem_init_parallel(void)
+{
+	// Help build the free lists for all the remaining memory.
+	while (mem_grow())
+		;
+
+	if (!cpu_onboot()) {
+		// Wait until the boot CPU has checked the allocator.
+		while (!mem_ready)
+			pause();
+		return;
+	}
 
+	cprintf("mem_init: %d pages in %d deferred chunks, %lld cycles\n",
+		mem_npage, mem_nchunk, rdtsc() - mem_inittsc);
 
-	#define page(addr)	((addr)/PAGESIZE)
+	// Check to make sure the page allocator seems to work correctly.
+	mem_check();
 
-	static pageinfo pi[page(ONE_GB)];
-	mem_pageinfo = pi;
+	// mem_check() briefly allocated all of memory: forget that.
+	mem_lock();
+	mem_peakused = mem_ntotal - mem_nfree;
+	spinlock_release(&mem_c_lock);
 
-	cprintf("pi=0x%08x  start=0x%08x  end=0x%08x\n", pi, start, end);
+	xchg(&mem_ready, 1);
+}
 
-	pageinfo **freetail = &mem_freelist;
+// Push the free block of 2^order pages starting at pi onto its free list.
+static void
+mem_freelist_push(pageinfo *pi, int order)
+{
+	pi->order = order;
+	pi->free = 1;
+	pi->free_prev = &mem_freelist[order];
+	pi->free_next = mem_freelist[order];
+	if (pi->free_next)
+		pi->free_next->free_prev = &pi->free_next;
+	mem_freelist[order] = pi;
+}
 
-	void free(int n) {
-		// A free page has no references to it.
-		mem_pageinfo[n].refcount = 0;
+// Unlink the free block starting at pi from whatever free list it is on.
+static void
+mem_freelist_remove(pageinfo *pi)
+{
+	*pi->free_prev = pi->free_next;
+	if (pi->free_next)
+		pi->free_next->free_prev = pi->free_prev;
+	pi->free_next = NULL;
+	pi->free_prev = NULL;
+	pi->free = 0;
+}
 
-		// Add the page to the end of the free list.
-		*freetail = &mem_pageinfo[n];
-		freetail = &mem_pageinfo[n].free_next;
+// Take a block of 2^order pages off the free lists,
+// splitting a larger block if there is no free block of exactly that order.
+// Caller must hold mem_c_lock.
+static pageinfo *
+mem_buddy_alloc(int order)
+{
+	int o = order;
+	while (!mem_freelist[o])
+		if (++o > MEM_MAXORDER)
+			return NULL;
+
+	pageinfo *pi = mem_freelist[o];
+	mem_freelist_remove(pi);
+
+	// Give back the upper half of the block until it is small enough.
+	while (o > order) {
+		o--;
+		mem_freelist_push(pi + (1 << o), o);
 	}
+	pi->order = order;
+	mem_nfree -= 1 << order;
+	mem_peakused = MAX(mem_peakused, mem_ntotal - mem_nfree);
+	return pi;
+}
 
-	
-	int i;
-	for (i = 0; i < mem_npage; i++) {	//262,144
-		if ( i == 0 || i == 1) {
-			continue;
-		}
-		if ( i < page(MEM_IO)) {	//160
-			free(i);
-		}
-		if ( i < page(MEM_EXT)) {	//256
-			continue;
-		}
-		if ( i >= page(mem_phys(start)) && i <= page(mem_phys(end))) {	//256 to 777
-			continue;
-		}
-		free(i);
+// Put a block of 2^order pages back on the free lists,
+// merging it with its buddy for as long as the buddy is also free.
+// Caller must hold mem_c_lock.
+static void
+mem_buddy_free(pageinfo *pi, int order)
+{
+	size_t n = pi - mem_pageinfo;
+	mem_nfree += 1 << order;
+
+	while (order < MEM_MAXORDER) {
+		size_t bn = n ^ (1 << order);
+		if (bn >= mem_npage)
+			break;
+		pageinfo *buddy = &mem_pageinfo[bn];
+		if (buddy->free != 1 || buddy->order != order)
+			break;
+		mem_freelist_remove(buddy);
+		n &= ~(1 << order);
+		order++;
+	}
+	mem_freelist_push(&mem_pageinfo[n], order);
+}
 
+// Find the whole pages lying within a BIOS memory map entry,
+// clipped to the physical address space we manage (MEM_MAXPHYS).
+// Returns false if the entry contains no such page.
+static bool
+mem_e820_range(e820entry *e, uint32_t *lo, uint32_t *hi)
+{
+	uint64_t elo = e->addr, ehi = e->addr + e->len;
+	if (ehi > MEM_MAXPHYS)
+		ehi = MEM_MAXPHYS;
+	if (elo >= ehi)
+		return false;
+	*lo = ROUNDUP((uint32_t) elo, PAGESIZE);
+	*hi = ROUNDDOWN((uint32_t) ehi, PAGESIZE);
+	return *lo < *hi;
+}
+
+// Add the physical pages [lo,hi) to the free lists,
+// carving the range into the largest naturally aligned blocks that fit.
+// Blocks are freed via mem_buddy_free() so that they also merge with
+// free blocks from adjacent ranges.
+static void
+mem_free_range(size_t lo, size_t hi)
+{
+	size_t n;
+
+        // if there's a page that shouldn't be on
+        // the free list, try to make sure it
+        // eventually causes trouble.
+	// Do this before taking the lock, so CPUs can do it in parallel.
+	for (n = lo; n < hi; n++)
+		memset(mem_ptr(n * PAGESIZE), 0x97, 128);
+
+	mem_lock();
+	mem_ntotal += hi - lo;
+	while (lo < hi) {
+		int order = 0;
+		while (order < MEM_MAXORDER && (lo & ((2 << order) - 1)) == 0
+				&& lo + (2 << order) <= hi)
+			order++;
+		mem_buddy_free(&mem_pageinfo[lo], order);
+		lo += 1 << order;
 	}
-	*freetail = NULL;	// null-terminate the freelist
+	spinlock_release(&mem_c_lock);
+}
 
-	// ...and remove this when you're ready.
-	//panic("mem_init() not implemented");
+// Free the pages in [lo,hi) that aren't reserved for other purposes:
+//  1) page 0 holds the real-mode IDT, BIOS structures and the E820 map;
+//  2) page 1 holds the AP bootstrap code (boot/bootother.S);
+//  3) the I/O hole [MEM_IO, MEM_EXT) can never be allocated;
+//  4) the kernel and the pageinfo array occupy [start, mem_kernend).
+static void
+mem_free_avail(size_t lo, size_t hi)
+{
+	const size_t rlo[] = { 0, page(MEM_IO), page(mem_phys(start)) };
+	const size_t rhi[] = { 2, page(MEM_EXT), mem_kernend };
+	int i;
 
-	spinlock_init(&mem_c_lock);
+	for (i = 0; i < 3 && lo < hi; i++) {	// reserved ranges are sorted
+		if (lo < rlo[i])
+			mem_free_range(lo, MIN(hi, rlo[i]));
+		lo = MAX(lo, rhi[i]);
+	}
+	if (lo < hi)
+		mem_free_range(lo, hi);
+}
 
-	// Check to make sure the page allocator seems to work correctly.
-	mem_check();
+// Initialize the pageinfo structs for pages [lo,hi),
+// then free the usable pages among them.
+// Every pageinfo field starts out zero: the page isn't free until freed.
+// The range must start on a MEM_CHUNK boundary and, unless it extends
+// to mem_npage, end on one, so that no buddy block crosses its edges.
+static void
+mem_init_pages(size_t lo, size_t hi)
+{
+	int i;
+
+	memset(&mem_pageinfo[lo], 0, (hi - lo) * sizeof(pageinfo));
+	for (i = 0; i < mem_nram; i++)
+		mem_free_avail(MAX(lo, mem_ram[i].lo), MIN(hi, mem_ram[i].hi));
 }
 
 //
@@ -143,20 +378,173 @@ mem_init(void)
 //
 // Hint: pi->refs should not be incremented 
 // Hint: be sure to use proper mutual exclusion for multiprocessor operation.
+// Mark a page as going into or out of a CPU's cache, in debug builds.
+static void
+mem_pcpu_mark(pageinfo *pi, bool cached)
+{
+#if PIOS_DEBUG >= 1
+	pi->free = cached ? MEM_CACHED : 0;
+#endif
+}
+
+// Give back this CPU's cached pages if another CPU ran out.
+static void
+mem_pcpu_drainreq(mem_pcpu *pc)
+{
+	if (pc->drainreq) {
+		pc->drainreq = false;
+		if (pc->npage > 0)
+			mem_pcpu_drain(pc, pc->npage);
+	}
+}
+
+// Ask every other CPU holding cached pages to give them back.
+static void
+mem_pcpu_reclaim(void)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c != cpu_cur() && c->mem.npage > 0)
+			c->mem.drainreq = true;
+}
+
 pageinfo *
 mem_alloc(void)
 {
-	// Fill this function in
-	// Fill this function in.
-	//panic("mem_alloc not implemented.");
+	mem_pcpu *pc = &cpu_cur()->mem;
+
+	mem_pcpu_drainreq(pc);
+	if (pc->npage > 0)
+		pc->allochit++;
+	else {
+		// Refill half of the local cache from the global free lists.
+		pc->allocmiss++;
+		mem_lock();
+		while (pc->npage < MEM_PCPU_BATCH) {
+			pageinfo *pi = mem_buddy_alloc(0);
+			if (pi == NULL)
+				break;
+			mem_pcpu_mark(pi, true);
+			pc->page[pc->npage++] = pi;
+		}
+		spinlock_release(&mem_c_lock);
+		if (pc->npage == 0) {
+			if (mem_grow())
+				return mem_alloc();
+			// Last resort: a page cleared for mem_alloc_zeroed().
+			mem_lock();
+			pageinfo *pi = mem_zero_take();
+			spinlock_release(&mem_c_lock);
+			if (pi != NULL)
+				pc->nalloc++;
+			else
+				mem_pcpu_reclaim();
+			return pi;
+		}
+	}
+	pc->nalloc++;
+	pageinfo *pi = pc->page[--pc->npage];
+	mem_pcpu_mark(pi, false);
+	return pi;
+}
+
+// Clear a page without pulling it into the cache, if we can.
+static void
+mem_zero_page(void *va)
+{
+	if (!mem_zero_nt) {
+		memset(va, 0, PAGESIZE);
+		return;
+	}
+	uint32_t *p = va, *e = p + PAGESIZE/4;
+	for (; p < e; p += 4)
+		asm volatile("movnti %1,0(%0); movnti %1,4(%0);"
+			" movnti %1,8(%0); movnti %1,12(%0)"
+			: : "r" (p), "r" (0) : "memory");
+	sfence();	// make the page visible before we publish it
+}
 
-	spinlock_acquire(&mem_c_lock);
-	pageinfo *head = mem_freelist;
-	if (head) {
-		mem_freelist = mem_freelist->free_next;
+// Take a page off the pre-zeroed pool, if there is one.
+// Caller must hold mem_c_lock.
+static pageinfo *
+mem_zero_take(void)
+{
+	pageinfo *pi = mem_zerolist;
+	if (pi != NULL) {
+		mem_zerolist = pi->free_next;
+		pi->free_next = NULL;
+		mem_nzero--;
+	}
+	return pi;
+}
+
+pageinfo *
+mem_alloc_zeroed(void)
+{
+	mem_lock();
+	pageinfo *pi = mem_zero_take();
+	if (pi != NULL)
+		mem_zerohit++;
+	else
+		mem_zeromiss++;
+	spinlock_release(&mem_c_lock);
+	if (pi != NULL) {
+		cpu_cur()->mem.nalloc++;
+		return pi;
+	}
+
+	// Pool is empty: clear a page the slow way.
+	pi = mem_alloc();
+	if (pi != NULL)
+		memset(mem_pi2ptr(pi), 0, PAGESIZE);
+	return pi;
+}
+
+bool
+mem_zero_idle(void)
+{
+	mem_pcpu_drainreq(&cpu_cur()->mem);
+
+	// Leave memory alone until the allocator has been checked.
+	if (!mem_ready || mem_nzero >= MEM_ZEROMAX)
+		return false;
+
+	// Take a single page straight from the free lists,
+	// leaving this CPU's cache of hot pages alone.
+	mem_lock();
+	pageinfo *pi = mem_buddy_alloc(0);
+	spinlock_release(&mem_c_lock);
+	if (pi == NULL)
+		return false;
+
+	mem_zero_page(mem_pi2ptr(pi));
+
+	mem_lock();
+	if (mem_nzero < MEM_ZEROMAX) {
+		pi->free_next = mem_zerolist;
+		mem_zerolist = pi;
+		mem_nzero++;
+	} else	// another CPU filled the pool meanwhile
+		mem_buddy_free(pi, 0);
+	spinlock_release(&mem_c_lock);
+	return true;
+}
+
+// Give the 'n' coldest pages in a CPU's page cache back to the free lists.
+static void
+mem_pcpu_drain(mem_pcpu *pc, int n)
+{
+	int i;
+
+	mem_lock();
+	for (i = 0; i < n; i++) {
+		mem_pcpu_mark(pc->page[i], false);
+		mem_buddy_free(pc->page[i], 0);
 	}
 	spinlock_release(&mem_c_lock);
-	return head;
+
+	pc->npage -= n;
+	memmove(&pc->page[0], &pc->page[n], pc->npage * sizeof(pc->page[0]));
 }
 
 //
@@ -166,15 +554,177 @@ mem_alloc(void)
 void
 mem_free(pageinfo *pi)
 {
-	// Fill this function in.
-	//panic("mem_free not implemented.");
+	mem_pcpu *pc = &cpu_cur()->mem;
+	mem_pcpu_drainreq(pc);
+	debug_assert(!pi->free);	// catch double frees, even of
+					// pages still in a CPU's cache
+#if PIOS_DEBUG >= 2
+	// Make use of the page after it's freed more likely to cause trouble.
+	memset(mem_pi2ptr(pi), 0x97, 128);
+#endif
+
+	pc->nfreed++;
+	if (pc->npage < MEM_PCPU_MAX)
+		pc->freehit++;
+	else {
+		pc->freemiss++;
+		mem_pcpu_drain(pc, MEM_PCPU_BATCH);
+	}
+	mem_pcpu_mark(pi, true);
+	pc->page[pc->npage++] = pi;
+}
 
-	spinlock_acquire(&mem_c_lock);
-	pi->free_next = mem_freelist;
-	mem_freelist = pi;
+void
+mem_drain(void)
+{
+	mem_pcpu *pc = &cpu_cur()->mem;
+	if (pc->npage > 0)
+		mem_pcpu_drain(pc, pc->npage);
+}
+
+pageinfo *
+mem_alloc_order(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+
+	pageinfo *pi;
+	do {
+		mem_lock();
+		pi = mem_buddy_alloc(order);
+		spinlock_release(&mem_c_lock);
+	} while (pi == NULL && mem_grow());
+	if (pi != NULL)
+		cpu_cur()->mem.nalloc += 1 << order;
+	return pi;
+}
+
+void
+mem_free_order(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	assert(((pi - mem_pageinfo) & ((1 << order) - 1)) == 0);
+	assert(!pi->free);	// catch double frees
+
+	cpu_cur()->mem.nfreed += 1 << order;
+	mem_lock();
+	mem_buddy_free(pi, order);
 	spinlock_release(&mem_c_lock);
-	return;
+}
 
+void
+mem_stat(memstat *ms)
+{
+	cpu *c;
+	int o;
+
+	memset(ms, 0, sizeof(*ms));
+	ms->npage = mem_npage;
+
+	mem_lock();
+	ms->ntotal = mem_ntotal;
+	ms->nfree = mem_nfree + mem_nzero;
+	ms->nzero = mem_nzero;
+	ms->peakused = mem_peakused;
+	ms->zerohit = mem_zerohit;
+	ms->zeromiss = mem_zeromiss;
+	assert(MEM_NORDERS <= MEMSTAT_NORDERS);
+	for (o = 0; o <= MEM_MAXORDER; o++) {
+		pageinfo *pi;
+		for (pi = mem_freelist[o]; pi != NULL; pi = pi->free_next)
+			ms->freeblocks[o]++;
+	}
+	spinlock_release(&mem_c_lock);
+
+	// Other CPUs' counters may be changing under us: that's OK.
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		mem_pcpu *pc = &c->mem;
+		ms->ncached += pc->npage;
+		ms->nalloc += pc->nalloc;
+		ms->nfreed += pc->nfreed;
+		ms->allochit += pc->allochit;
+		ms->allocmiss += pc->allocmiss;
+		ms->freehit += pc->freehit;
+		ms->freemiss += pc->freemiss;
+		ms->nlock += pc->nlock;
+		ms->lockcycles += pc->lockcycles;
+	}
+	ms->nfree += ms->ncached;
+}
+
+void
+mem_stat_print(const memstat *ms)
+{
+	int o;
+
+	cprintf("mem: %d pages, %d usable, %d free (%d cached, %d zeroed), "
+		"peak %d used\n", ms->npage, ms->ntotal, ms->nfree,
+		ms->ncached, ms->nzero, ms->peakused);
+	cprintf("mem: free blocks by order:");
+	for (o = 0; o <= MEM_MAXORDER; o++)
+		cprintf(" %d", ms->freeblocks[o]);
+	cprintf("\n");
+	cprintf("mem: %lld allocs, %lld frees\n", ms->nalloc, ms->nfreed);
+	cprintf("mem: cpu cache alloc %lld hit %lld miss, "
+		"free %lld hit %lld miss\n", ms->allochit, ms->allocmiss,
+		ms->freehit, ms->freemiss);
+	cprintf("mem: zero pool %lld hit %lld miss\n",
+		ms->zerohit, ms->zeromiss);
+	cprintf("mem: mem_c_lock taken %lld times, %lld cycles to acquire\n",
+		ms->nlock, ms->lockcycles);
+}
+
+void
+mem_bench(void)
+{
+	static uint64_t cycles[CPU_MAX];	// Time taken by each CPU
+	int ncpus = ismp ? ncpu : 1;
+	int batch, i;
+
+	for (batch = 1; batch <= MEM_BENCH_MAXBATCH; batch *= 4) {
+		bench_barrier();
+
+		uint64_t t0 = rdtsc();
+		uint32_t n;
+		for (n = 0; n < MEM_BENCH_OPS; n += batch) {
+			pageinfo *fl = NULL, *pi;
+			for (i = 0; i < batch; i++) {
+				pi = mem_alloc();
+				assert(pi != NULL);
+				pi->free_next = fl;
+				fl = pi;
+			}
+			while ((pi = fl) != NULL) {
+				fl = pi->free_next;
+				mem_free(pi);
+			}
+		}
+		cycles[cpu_cur()->num] = rdtsc() - t0;
+
+		bench_barrier();
+		if (!cpu_onboot())
+			continue;
+
+		// Total throughput is all CPUs' operations
+		// over the time the slowest CPU took.
+		uint64_t maxcycles = 0, sumcycles = 0;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			uint64_t t = cycles[c->num];
+			cprintf("membench: ncpu=%d batch=%d cpu=%d ops=%d "
+				"cycles=%lld cyc/op=%lld ops/s=%lld\n",
+				ncpus, batch, c->num, MEM_BENCH_OPS, t,
+				t / MEM_BENCH_OPS,
+				bench_persec(MEM_BENCH_OPS, t));
+			maxcycles = MAX(maxcycles, t);
+			sumcycles += t;
+		}
+		uint64_t ops = (uint64_t) MEM_BENCH_OPS * ncpus;
+		cprintf("membench: ncpu=%d batch=%d cpu=all ops=%lld "
+			"cycles=%lld cyc/op=%lld ops/s=%lld\n",
+			ncpus, batch, ops, maxcycles, sumcycles / ops,
+			bench_persec(ops, maxcycles));
+	}
+	mem_drain();
 }
 
 //
@@ -186,17 +736,23 @@ mem_check()
 {
 	pageinfo *pp, *pp0, *pp1, *pp2;
 	pageinfo *fl;
-	int i;
+	int nblocks[MEM_NORDERS];
+	int i, o;
 
-        // if there's a page that shouldn't be on
-        // the free list, try to make sure it
-        // eventually causes trouble.
+	// Free pages were filled with junk by mem_free_range().
+	// Count them, with nothing left in this CPU's cache.
+	mem_drain();
 	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
-		memset(mem_pi2ptr(pp), 0x97, 128);
-		freepages++;
+	for (o = 0; o <= MEM_MAXORDER; o++) {
+		nblocks[o] = 0;
+		for (pp = mem_freelist[o]; pp != 0; pp = pp->free_next) {
+			assert(pp->free && pp->order == o);
+			nblocks[o]++;
+			freepages += 1 << o;
+		}
 	}
 	cprintf("mem_check: %d free pages\n", freepages);
+	assert(freepages == mem_nfree);
 	assert(freepages < mem_npage);	// can't have more free than total!
 	assert(freepages > 16000);	// make sure it's in the right ballpark
 
@@ -213,9 +769,14 @@ mem_check()
         assert(mem_pi2phys(pp1) < mem_npage*PAGESIZE);
         assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
-	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	// temporarily steal the rest of the free pages,
+	// splitting every buddy block down to single pages
+	fl = NULL;
+	while ((pp = mem_alloc()) != NULL) {
+		pp->free_next = fl;
+		fl = pp;
+	}
+	assert(mem_nfree == 0);
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
@@ -224,6 +785,8 @@ mem_check()
         mem_free(pp0);
         mem_free(pp1);
         mem_free(pp2);
+	debug_assert(pp0->free == MEM_CACHED);	// caught if freed again
+	debug_assert(pp2->free == MEM_CACHED);
 	pp0 = pp1 = pp2 = 0;
 	pp0 = mem_alloc(); assert(pp0 != 0);
 	pp1 = mem_alloc(); assert(pp1 != 0);
@@ -231,15 +794,46 @@ mem_check()
 	assert(pp0);
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
+	assert(!pp0->free && !pp1->free && !pp2->free);
 	assert(mem_alloc() == 0);
 
 	// give free list back
-	mem_freelist = fl;
+	while (fl) {
+		pp = fl;
+		fl = fl->free_next;
+		mem_free(pp);
+	}
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
+	mem_drain();
+	assert(cpu_cur()->mem.npage == 0);
+
+	// all those single pages should have coalesced
+	// back into exactly the blocks we started with
+	assert(mem_nfree == freepages);
+	for (o = 0; o <= MEM_MAXORDER; o++) {
+		int n = 0;
+		for (pp = mem_freelist[o]; pp != 0; pp = pp->free_next)
+			n++;
+		assert(n == nblocks[o]);
+	}
+
+	// contiguous allocations must be naturally aligned and disjoint,
+	// and must merge back with their buddies when freed
+	for (o = 1; o <= MEM_MAXORDER; o++) {
+		pp0 = mem_alloc_order(o); assert(pp0 != 0);
+		pp1 = mem_alloc_order(o); assert(pp1 != 0);
+		assert(((pp0 - mem_pageinfo) & ((1 << o) - 1)) == 0);
+		assert(((pp1 - mem_pageinfo) & ((1 << o) - 1)) == 0);
+		assert(pp1 >= pp0 + (1 << o) || pp0 >= pp1 + (1 << o));
+		assert(mem_nfree == freepages - (2 << o));
+		mem_free_order(pp0, o);
+		mem_free_order(pp1, o);
+	}
+	assert(mem_nfree == freepages);
 
 	cprintf("mem_check() succeeded!\n");
 }
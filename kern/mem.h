@@ -18,6 +18,9 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/x86.h>
+#include <inc/kstat.h>
+
+#include <kern/debug.h>
 
 
 // At physical address MEM_IO (640K) there is a 384K hole for I/O.
@@ -25,6 +28,10 @@
 #define MEM_IO		0x0A0000
 #define MEM_EXT		0x100000
 
+// We manage physical memory up to 4GB, less one page so that
+// the maximum physical address (mem_max) still fits in 32 bits.
+#define MEM_MAXPHYS	0xFFFFF000
+
 
 // Given a physical address,
 // return a C pointer the kernel can use to access it.
@@ -38,17 +45,95 @@
 #define mem_phys(ptr)		((uint32_t)(ptr))
 
 
+// Free physical memory is managed as a binary buddy system:
+// a block of order n is 2^n physically contiguous pages,
+// aligned on a 2^n-page boundary, whose "buddy" is the adjacent block
+// with which it merges into a block of order n+1 when both are free.
+// The largest order is a 4MB block, the size of an x86 large page (PTSIZE).
+#define MEM_MAXORDER	10
+#define MEM_NORDERS	(MEM_MAXORDER+1)
+
+
 // A pageinfo struct holds metadata on how a particular physical page is used.
 // On boot we allocate a big array of pageinfo structs, one per physical page.
 // This could be a union instead of a struct,
 // since only one member is used for a given page state (free, allocated) -
 // but that might make debugging a bit more challenging.
+// Only the first page of a free buddy block is on a free list;
+// the other pages' pageinfo structs are unused until the block is split.
 typedef struct pageinfo {
-	struct pageinfo	*free_next;	// Next page number on free list
+	struct pageinfo	*free_next;	// Next block on free list
+	struct pageinfo	**free_prev;	// Pointer that points to us on free list
 	int32_t	refcount;		// Reference count on allocated pages
+	int16_t	order;			// Buddy order of block starting here
+	int16_t	free;			// 1 if block starting here is free,
+					// MEM_CACHED if in a CPU's cache
 } pageinfo;
 
 
+// To speed up booting on large-memory machines, mem_init() by default
+// builds the free lists only for the memory needed to boot.
+// The rest is initialized in chunks of MEM_CHUNK pages,
+// by all CPUs in parallel once they are running (mem_init_parallel),
+// or on demand by an allocation that finds no free memory.
+// Build with DEFS=-DMEM_DEFERINIT=0 to initialize everything up front.
+#ifndef MEM_DEFERINIT
+#define MEM_DEFERINIT	1
+#endif
+#define MEM_CHUNK	4096	// Must be a multiple of 2^MEM_MAXORDER pages
+
+
+// Each CPU keeps a small cache of free single pages in its cpu struct,
+// refilled from and drained to the global free lists in batches,
+// so that most mem_alloc()/mem_free() calls never touch mem_c_lock.
+// In debug builds, a page in a CPU's cache has pageinfo.free set to
+// MEM_CACHED, so mem_free() catches it being freed again while there;
+// in release builds cached pages look allocated.
+// A CPU that runs out of pages asks the others to give back their caches,
+// which they do at their next mem_alloc() or mem_free(), or when idle:
+// so mem_alloc() can fail while up to MEM_PCPU_MAX pages per CPU
+// are still cached elsewhere, and succeed when retried a little later.
+// Only the owning CPU ever touches its cache, so no lock is needed;
+// interrupts may be on meanwhile, which is safe only because
+// no interrupt handler allocates or frees pages.  Keep it that way.
+#define MEM_PCPU_MAX	32	// Maximum number of pages in a CPU's cache
+#define MEM_PCPU_BATCH	16	// Pages moved to/from the global lists at once
+#define MEM_CACHED	(-1)	// pageinfo.free of a cached page (debug)
+
+typedef struct mem_pcpu {
+	int		npage;			// Number of cached pages
+	struct pageinfo	*page[MEM_PCPU_MAX];	// Cached pages, hottest last
+	uint32_t	allochit;	// mem_alloc()s served from the cache
+	uint32_t	allocmiss;	// mem_alloc()s that had to refill
+	uint32_t	freehit;	// mem_free()s absorbed by the cache
+	uint32_t	freemiss;	// mem_free()s that had to drain
+	uint32_t	nalloc;		// Pages allocated by this CPU
+	uint32_t	nfreed;		// Pages freed by this CPU
+	uint32_t	nlock;		// Times this CPU took mem_c_lock
+	uint64_t	lockcycles;	// Cycles spent acquiring mem_c_lock
+	volatile bool	drainreq;	// Another CPU wants our pages back
+} mem_pcpu;
+
+
+// Idle CPUs keep a pool of up to MEM_ZEROMAX pages already cleared to zero,
+// so that mem_alloc_zeroed() needn't clear pages on the critical path.
+// They use non-temporal stores if the processor supports SSE2,
+// so clearing pages in the background doesn't flush useful data from cache.
+#define MEM_ZEROMAX	64
+
+
+// Parameters for mem_bench(), which runs when built with 'make BENCH=1'.
+// Each CPU does MEM_BENCH_OPS page allocations and frees
+// for each batch size from 1 up to MEM_BENCH_MAXBATCH, by factors of 4:
+// a batch allocates that many pages, then frees them all.
+#ifndef MEM_BENCH_OPS
+#define MEM_BENCH_OPS		(1 << 18)	// Must be a multiple of MAXBATCH
+#endif
+#ifndef MEM_BENCH_MAXBATCH
+#define MEM_BENCH_MAXBATCH	256
+#endif
+
+
 // The pmem module sets up the following globals during mem_init().
 extern size_t mem_max;		// Maximum physical address
 extern size_t mem_npage;	// Total number of physical memory pages
@@ -71,21 +156,58 @@ extern char start[], end[];
 // Detect available physical memory and initialize the mem_pageinfo array.
 void mem_init(void);
 
+// Called on every CPU once all CPUs are running:
+// helps finish building the free lists, then checks the allocator.
+// Returns once physical memory is fully initialized.
+void mem_init_parallel(void);
+
 // Allocate a physical page and return a pointer to its pageinfo struct.
-// Returns NULL if no more physical pages are available.
+// Returns NULL if no more physical pages are available,
+// other than those in other CPUs' caches (see mem_pcpu above).
 pageinfo *mem_alloc(void);
 
+// Allocate a physical page whose contents are all zero,
+// taking it from the pre-zeroed pool if possible.
+// Returns NULL if mem_alloc() would.
+pageinfo *mem_alloc_zeroed(void);
+
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Return all pages cached by the current CPU to the global free lists.
+void mem_drain(void);
+
+// Called by an idle CPU to clear one more page for the pre-zeroed pool.
+// Returns false if there was nothing to do.
+bool mem_zero_idle(void);
+
+// Allocate 2^order physically contiguous pages, aligned on a 2^order page
+// boundary, and return a pointer to the first page's pageinfo struct.
+// Returns NULL if no free block of at least that order is available.
+pageinfo *mem_alloc_order(int order);
+
+// Return a block allocated with mem_alloc_order(order) to the free lists,
+// coalescing it with its buddy blocks as far as possible.
+void mem_free_order(pageinfo *pi, int order);
+
+// Measure mem_alloc()/mem_free() throughput on all CPUs at once.
+// Called on every CPU; prints one "membench:" line per CPU and batch size.
+void mem_bench(void);
+
+// Collect allocator statistics, summing the per-CPU counters.
+void mem_stat(memstat *ms);
+
+// Dump allocator statistics to the console.
+void mem_stat_print(const memstat *ms);
+
 
 
 // Atomically increment the reference count on a page.
 static gcc_inline void
 mem_incref(pageinfo *pi)
 {
-	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	debug_assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
+	debug_assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
 	lockadd(&pi->refcount, 1);
 }
@@ -95,12 +217,12 @@ mem_incref(pageinfo *pi)
 static gcc_inline void
 mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 {
-	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	debug_assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
+	debug_assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
 	if (lockaddz(&pi->refcount, -1))
 			freefun(pi);
-	assert(pi->refcount >= 0);
+	debug_assert(pi->refcount >= 0);
 }
 
 
@@ -128,6 +128,11 @@ mp_init(void)
 			// Get a cpu struct and kernel stack for this CPU.
 			cpu *c = (proc->flags & MPBOOT)
 					? &cpu_boot : cpu_alloc(); // cpu_alloc chains the cpus together
+			if (c == NULL) {
+				warn("mp_init: too many CPUs, ignoring APIC %d",
+					proc->apicid);
+				continue;
+			}
 			c->id = proc->apicid;
 			ncpu++;
 			continue;
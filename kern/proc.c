@@ -10,13 +10,21 @@
 #include <inc/string.h>
 #include <inc/syscall.h>
 #include <inc/stdio.h>
+#include <inc/kstat.h>
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
+#include <kern/kmem.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/init.h>
 #include <kern/ready_queue.h>
+#include <kern/proctrace.h>
+#include <kern/mp.h>
+#include <kern/bench.h>
+
+#include <dev/lapic.h>
+#include <dev/pit.h>
 
 
 
@@ -24,8 +32,9 @@ proc proc_null;		// null process - just leave it initialized to 0
 
 proc *proc_root;	// root process, once it's created in init()
 
-// LAB 2: insert your scheduling data structure declarations here.
-ready_queue redi_ku;		//process ready queue
+static kmem_cache proc_cache;	// packs proc structs several to a page
+
+static spinlock proc_rt_lock;	// serializes real-time admission
 
 
 
@@ -38,7 +47,12 @@ proc_init(void)
 		return;
 
 	// your module initialization code here
-	ready_queue_init(&redi_ku);
+	kmem_cache_init(&proc_cache, "proc", sizeof(proc),
+			__alignof__(proc), NULL);
+	spinlock_init(&proc_rt_lock);
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		ready_queue_init(&c->runq);
 	proc_root = proc_alloc(0,0);
 }
 
@@ -47,12 +61,10 @@ proc_init(void)
 proc *
 proc_alloc(proc *p, uint32_t cn)
 {
-	pageinfo *pi = mem_alloc();
-	if (!pi)
+	proc *cp = kmem_cache_alloc(&proc_cache);
+	if (!cp)
 		return NULL;
-	mem_incref(pi);
 
-	proc *cp = (proc*)mem_pi2ptr(pi);
 	memset(cp, 0, sizeof(proc));
 	spinlock_init(&cp->lock);
 	cp->parent = p;
@@ -72,13 +84,446 @@ proc_alloc(proc *p, uint32_t cn)
 
 
 
-// Put process p in the ready state and add it to the ready queue.
+// Start a new period for real-time process p, which was blocked,
+// if its last one is over; otherwise it gets the rest of that one.
+static void
+proc_rt_wake(proc *p)
+{
+	uint64_t now = rdtsc();
+	if (p->rtcpu != NULL && now >= p->rtdeadline) {
+		p->rtdeadline = now + p->rtperiod;
+		p->rtleft = p->rtbudget;
+	}
+}
+
+// Start the next period of real-time process p, which is ready or running,
+// if its current one is over.  If it still had budget left, it wanted
+// the CPU at its deadline and didn't get enough of it: a deadline miss.
+static void
+proc_rt_renew(proc *p, uint64_t now)
+{
+	if (now < p->rtdeadline)
+		return;
+	if (p->rtleft > 0) {
+		p->rtmiss++;
+		p->rtcpu->rtmiss++;
+		proctrace(SCHEDEV_MISS, p);
+	}
+
+	// Periods that went by entirely while it waited don't count again.
+	p->rtdeadline += p->rtperiod
+			* ((now - p->rtdeadline) / p->rtperiod + 1);
+	p->rtleft = p->rtbudget;
+}
+
+// Return true if real-time process p has used up its budget
+// for a period that isn't over yet.
+static bool
+proc_rt_throttled(proc *p)
+{
+	return p->rtcpu != NULL && p->rtleft == 0 && rdtsc() < p->rtdeadline;
+}
+
+// Return the timer tick length that goes off at TSC time 'when',
+// as nearly as the timer can.
+static uint32_t
+proc_rt_us(uint64_t when)
+{
+	uint64_t now = rdtsc();
+	uint64_t us = when > now ? (when - now) * 1000000 / pit_tschz : 0;
+	return MAX(LAPIC_TICK_MIN, MIN(us, LAPIC_TICK_MAX));
+}
+
+// Charge running process p for the CPU time it has used up to 'now',
+// against its budget as well if it is real-time.
+static void
+proc_charge(proc *p, uint64_t now)
+{
+	uint64_t ran = now - p->runstart;
+	p->runtime += ran;
+	p->runstart = now;
+	p->rtleft -= MIN(p->rtleft, ran);
+}
+
+// Give a process that blocked before its time slice was up
+// a fresh slice one priority level higher,
+// and a new period if it is real-time and its last one is over.
+static void
+proc_promote(proc *p)
+{
+	if (p->prio > 0)
+		p->prio--;
+	p->sliceticks = 0;
+	proc_rt_wake(p);
+}
+
+// Return true if process p may run on CPU c:
+// a real-time process only on the one it is bound to.
+static bool
+proc_allowed(proc *p, cpu *c)
+{
+	if (p->rtcpu != NULL)
+		return c == p->rtcpu;
+	return p->sv.sched.affinity == 0
+		|| (p->sv.sched.affinity & (1 << c->num)) != 0;
+}
+
+// Choose which CPU's ready queue process p should go on:
+// the one it last ran on, unless that's too much busier than this one
+// (see PROC_IMBALANCE); otherwise this one, if p may run here;
+// otherwise the least busy CPU it may run on.
+static cpu *
+proc_choosecpu(proc *p)
+{
+	if (p->rtcpu != NULL)
+		return p->rtcpu;
+
+	cpu *here = cpu_cur(), *c = p->lastcpu;
+	bool hereok = proc_allowed(p, here);
+	if (c != NULL && c != here && proc_allowed(p, c) && (!hereok
+			|| c->runq.len <= here->runq.len + PROC_IMBALANCE))
+		return c;
+	if (hereok)
+		return here;
+
+	cpu *best = NULL;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (proc_allowed(p, c) && (best == NULL
+				|| c->runq.len < best->runq.len))
+			best = c;
+	assert(best != NULL);	// syscall.c keeps affinity masks sane
+	return best;
+}
+
+// Add ready process p to the ready queue of the CPU it should run on.
+// If that CPU stays busy, an idle one will steal p (see proc_sched()).
+static void
+proc_enqueue(proc *p)
+{
+	cpu *c = proc_choosecpu(p);
+	ready_queue_append(&c->runq, p);
+
+	// Wake up the CPU we chose if it is idle, or else any idle CPU
+	// that p may run on, to come steal it.
+	// The barrier orders our append before our check of 'idle',
+	// as proc_sched() orders setting 'idle' before checking the queues:
+	// so either we see it idle, or it sees our process.
+	membar();
+	if (c->idle && xchg(&c->idle, 0)) {
+		lapic_ipi(c->id, T_RESCHED);
+		return;
+	}
+
+	// A process running alone has no timer ticks to be preempted by,
+	// and one running ahead of a real-time process may need to be
+	// preempted right away: set the timer, here or with an IPI
+	// (see proc_settick()).
+	if (c == cpu_cur())
+		proc_settick();
+	else if (c->tickus == 0 || p->rtcpu != NULL)
+		lapic_ipi(c->id, T_RESCHED);
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->idle && proc_allowed(p, c) && xchg(&c->idle, 0)) {
+			lapic_ipi(c->id, T_RESCHED);
+			break;
+		}
+}
+
+// Put process p in the ready state and add it to a ready queue.
 void
 proc_ready(proc *p)
 {
 	//panic("proc_ready not implemented");
+	if (p->state != PROC_RUN) {	// wasn't just preempted
+		proc_promote(p);
+		proctrace(SCHEDEV_READY, p);
+	}
 	proc_mark(p, PROC_READY);
-	ready_queue_append(&redi_ku, p);
+	proc_enqueue(p);
+}
+
+// Put child process p, just started by the current process,
+// in the ready state and in this CPU's handoff slot instead of its queue,
+// since its parent is likely to wait for it next:
+// proc_wait() then switches straight to it, with no queue in the way.
+// A child its parent doesn't wait for runs when this CPU next schedules,
+// or is stolen by a CPU that finds nothing else to do (see proc_steal()).
+// The child goes here even if it last ran elsewhere, since its parent's
+// CPU is about to be free and the two share the parent's working set;
+// a child not allowed to run here is just queued as usual,
+// as is a real-time child, which must take its turn by deadline.
+void
+proc_handoff(proc *p)
+{
+	proc_promote(p);
+	proctrace(SCHEDEV_READY, p);
+	proc_mark(p, PROC_READY);
+	if (!proc_allowed(p, cpu_cur()) || p->rtcpu != NULL) {
+		proc_enqueue(p);
+		return;
+	}
+
+	// The slot holds only one process: queue any earlier one.
+	proc *old = (proc*) xchg((volatile uint32_t*) &cpu_cur()->runnext,
+				(uint32_t) p);
+	if (old)
+		proc_enqueue(old);
+	else
+		proc_settick();
+}
+
+// Take the process in CPU c's handoff slot, if it is still 'p'.
+static bool
+proc_takenext(cpu *c, proc *p)
+{
+	return p != NULL && cmpxchg((volatile uint32_t*) &c->runnext,
+				(uint32_t) p, 0) == (uint32_t) p;
+}
+
+// Return true if any CPU has ready processes.
+static bool
+proc_anyready(void)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->runq.len > 0)
+			return true;
+	return false;
+}
+
+// Take the oldest ready process we may run from the CPU with the most
+// of them, or failing that, a process left in another CPU's handoff slot.
+// Returns NULL if no CPU has any such processes.
+static proc *
+proc_steal(void)
+{
+	cpu *me = cpu_cur(), *c, *victim = NULL;
+	int maxlen = 0;
+	proc *p;
+
+	// The lengths may change under us: we only need a good guess.
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->runq.len > maxlen) {
+			maxlen = c->runq.len;
+			victim = c;
+		}
+	if (victim && (p = ready_queue_steal(&victim->runq, me->num)))
+		return p;
+
+	// A process in a handoff slot is usually about to be run
+	// by its parent's CPU: give that CPU a moment to get to it first.
+	uint64_t grace = pit_tschz / 1000000 * PROC_HANDOFF_US;
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		p = c->runnext;
+		if (p == NULL || c == me || !proc_allowed(p, me))
+			continue;
+		uint64_t t = rdtsc();
+		while (rdtsc() - t < grace && c->runnext == p)
+			pause();
+		if (proc_takenext(c, p))
+			return p;
+	}
+	return NULL;
+}
+
+// Take the real-time process with the earliest deadline before 'before'
+// and budget left off this CPU's queue, if there is one, after starting
+// new periods for the queued processes whose deadlines have passed.
+static proc *
+proc_rt_pop(cpu *c, uint64_t before)
+{
+	uint64_t now = rdtsc();
+	proc *p;
+	while ((p = ready_queue_rtexpired(&c->runq, now)) != NULL) {
+		proc_rt_renew(p, now);
+		ready_queue_append(&c->runq, p);
+	}
+	return ready_queue_rtpop(&c->runq, before);
+}
+
+// Take ready process p off the ready queue or handoff slot it is in.
+// Returns false if it isn't in one, say because a CPU just took it.
+static bool
+proc_unqueue(proc *p)
+{
+	struct ready_queue *q = p->readyq;
+	if (q != NULL)
+		return ready_queue_remove(q, p);
+
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->runnext == p)
+			return proc_takenext(c, p);
+	return false;
+}
+
+// Find another CPU to run gang member p right now, and claim it
+// by putting p in its gang slot: an idle CPU if there is one,
+// otherwise one that isn't already running a member of p's gang
+// or a real-time process.
+// Returns NULL if there is no such CPU.
+static cpu *
+proc_gang_place(proc *p)
+{
+	cpu *here = cpu_cur(), *c;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++)
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			if (c == here || !proc_allowed(p, c))
+				continue;
+			proc *cur = c->proc;
+			if (pass == 0 ? !c->idle : cur != NULL
+					&& cur->runcpu == c && (cur->gang == p->gang
+						|| cur->rtcpu != NULL))
+				continue;
+			if (cmpxchg((volatile uint32_t*) &c->gangnext,
+					0, (uint32_t) p) == 0)
+				return c;
+		}
+	return NULL;
+}
+
+// Co-schedule the gang of process p, which just started running here:
+// pull its ready members off their queues and send them to other CPUs,
+// which preempt what they're running for them (see proc_switch()).
+// Members we have no CPU for go back to waiting their turn,
+// and real-time members keep to their deadlines on their own CPUs.
+static void
+proc_gang_launch(proc *p)
+{
+	proc *m;
+	for (m = p->gang->members; m != NULL; m = m->gangpeer) {
+		if (m == p || m->state != PROC_READY || m->rtcpu != NULL
+				|| !proc_unqueue(m))
+			continue;
+		cpu *c = proc_gang_place(m);
+		if (c == NULL) {
+			proc_enqueue(m);
+			continue;
+		}
+		lapic_ipi(c->id, T_RESCHED);
+	}
+}
+
+// The time slice of process p, which is running here, is up:
+// preempt the members of its gang running on other CPUs as well,
+// so the gang gives up its CPUs as a unit (see proc_yield()).
+static void
+proc_gang_stop(proc *p)
+{
+	cpu *here = cpu_cur();
+	proc *m;
+	for (m = p->gang->members; m != NULL; m = m->gangpeer) {
+		cpu *c = m->runcpu;
+		if (m == p || m->state != PROC_RUN || c == NULL || c == here)
+			continue;
+		c->gangstop = p->gang;
+		lapic_ipi(c->id, T_RESCHED);
+	}
+}
+
+// Take the gang member another CPU sent us to run, if any.
+static proc *
+proc_takegang(cpu *c)
+{
+	if (c->gangnext == NULL)
+		return NULL;
+	return (proc*) xchg((volatile uint32_t*) &c->gangnext, 0);
+}
+
+bool
+proc_setgang(proc *p, uint32_t id)
+{
+	proc_gang *g = p->gang;
+	if (g != NULL && g->id == id)
+		return true;
+
+	// Leave our old gang, if any.
+	// Other CPUs may be walking its member list, but they'll just miss
+	// us or the members after us, and only p's parent changes it.
+	if (g != NULL) {
+		proc **pp = &g->members;
+		while (*pp != p)
+			pp = &(*pp)->gangpeer;
+		*pp = p->gangpeer;
+		p->gangpeer = NULL;
+		p->gang = NULL;
+		if (--g->nmember == 0)
+			kmem_free(g);
+	}
+	if (id == 0)
+		return true;
+
+	// Join a sibling's gang with this id, or start one.
+	proc *parent = p->parent;
+	int i;
+	g = NULL;
+	for (i = 0; i < PROC_CHILDREN && g == NULL; i++) {
+		proc *s = parent->child[i];
+		if (s != NULL && s->gang != NULL && s->gang->id == id)
+			g = s->gang;
+	}
+	if (g == NULL) {
+		g = kmem_alloc(sizeof(proc_gang));
+		if (g == NULL)
+			return false;
+		memset(g, 0, sizeof(*g));
+		g->id = id;
+	}
+	p->gang = g;
+	p->gangpeer = g->members;
+	g->members = p;
+	g->nmember++;
+	return true;
+}
+
+bool
+proc_setrt(proc *p)
+{
+	procsched *ps = &p->sv.sched;
+	bool ok = true;
+
+	// Give back p's old reservation, if any.
+	spinlock_acquire(&proc_rt_lock);
+	if (p->rtcpu != NULL) {
+		p->rtcpu->rtutil -= p->rtutil;
+		p->rtcpu = NULL;
+		p->rtutil = 0;
+	}
+	if (ps->period == 0 && ps->budget == 0)
+		goto done;
+
+	// The timer can't enforce budgets shorter than its shortest tick,
+	// nor time periods longer than its longest.
+	ok = false;
+	if (ps->budget < LAPIC_TICK_MIN || ps->budget > ps->period
+			|| ps->period > LAPIC_TICK_MAX || pit_tschz == 0)
+		goto done;
+
+	// Bind p to the CPU it may run on with the least reserved,
+	// if p's share of it fits there.
+	uint32_t util = ((uint64_t) ps->budget * 1000000 + ps->period - 1)
+			/ ps->period;
+	cpu *c, *best = NULL;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (proc_allowed(p, c)
+				&& (best == NULL || c->rtutil < best->rtutil))
+			best = c;
+	if (best == NULL || best->rtutil + util > PROC_RT_MAXUTIL * 10000)
+		goto done;
+
+	best->rtutil += util;
+	p->rtcpu = best;
+	p->rtutil = util;
+	p->rtperiod = pit_tschz * ps->period / 1000000;
+	p->rtbudget = pit_tschz * ps->budget / 1000000;
+	p->rtdeadline = 0;	// start a period when it's next started
+	p->rtleft = 0;
+	ok = true;
+done:
+	spinlock_release(&proc_rt_lock);
+	return ok;
 }
 
 #define INT_OPCODE_LEN 2
@@ -115,12 +560,19 @@ proc_wait(proc *parent, proc *child, trapframe *parent_tf)
 
 	}
 
+	// Save our state before a child on another CPU can see us waiting,
+	// since it will then run us right away (see proc_ret()).
+	proc_save(parent, parent_tf, PROC_SYSCALL_RESTART);
+	proctrace(SCHEDEV_WAIT, parent);
 	proc_mark(parent, PROC_WAIT);
+	membar();
 	parent->waitchild = child;
-	proc_save(parent, parent_tf, PROC_SYSCALL_RESTART);
 
-	// return to child indirectly thru ready queue
-	// for a child to run, it must go thru the ready queue
+	// If we just started the child and it hasn't been run or stolen yet,
+	// switch straight to it.
+	cpu *c = cpu_cur();
+	if (c->runnext == child && proc_takenext(c, child))
+		proc_run(child);
 	proc_sched();
 }
 
@@ -131,12 +583,38 @@ void gcc_noreturn
 proc_sched(void)
 {
 	//panic("proc_sched not implemented");
+	cpu *c = cpu_cur();
 	for (;;) {
-		proc *p = ready_queue_pop(&redi_ku);
+		proc *p = proc_takegang(c);
+		if (!p)
+			p = proc_rt_pop(c, ~0ULL);
+		if (!p && !proc_takenext(c, p = c->runnext))
+			p = ready_queue_pop(&c->runq, PROC_NPRIO-1);
+		if (!p)
+			p = proc_steal();
 		if (p) {
 			proc_run(p);
 		}
-		pause();
+
+		// Nothing to run: make ourselves useful,
+		// or else halt until an interrupt gives us something to do,
+		// or a real-time process here needs a new period.
+		// Only we take real-time processes off our queue,
+		// so if any come in meanwhile, there are more of them.
+		if (mem_zero_idle())
+			continue;
+		int rtlen = c->runq.rtlen;
+		uint64_t next = ready_queue_rtdeadline(&c->runq, false);
+		lapic_settick(next != ~0ULL ? proc_rt_us(next) : 0);
+		cli();
+		xchg(&c->idle, 1);
+		if (proc_anyready() || c->gangnext != NULL
+				|| c->runq.rtlen != rtlen)
+			c->idle = 0;	// something came in meanwhile
+		else
+			sti_hlt();
+		c->idle = 0;
+		sti();
 	}
 }
 
@@ -148,30 +626,189 @@ proc_run(proc *p)
 {
 	//panic("proc_run not implemented");
 	proc_mark(p, PROC_RUN);
+	proctrace(SCHEDEV_RUN, p);
+	if (p->gang)
+		proc_gang_launch(p);
+	proc_settick();
 	trap_return(&p->sv.tf);
 }
 
+// Return the timer tick length for this CPU while process p runs here
+// and real-time processes are about: one that goes off right away
+// if a queued process has an earlier deadline than p, or else when
+// a real-time p's budget runs out or its period ends, or a queued one's
+// period ends, whichever comes first.  A best-effort p still gets ticks
+// of 'us' microseconds, to take turns with others like it.
+static uint32_t
+proc_rt_tick(cpu *c, proc *p, uint32_t us)
+{
+	uint64_t mine = p->rtcpu != NULL ? p->rtdeadline : ~0ULL;
+	if (ready_queue_rtdeadline(&c->runq, true) < mine)
+		return LAPIC_TICK_MIN;
+
+	uint64_t next = ready_queue_rtdeadline(&c->runq, false);
+	if (p->rtcpu != NULL) {
+		uint64_t now = rdtsc();
+		uint64_t left = p->rtleft - MIN(p->rtleft, now - p->runstart);
+		return proc_rt_us(MIN(next, MIN(now + left, p->rtdeadline)));
+	}
+	if (next != ~0ULL)
+		us = MIN(us, proc_rt_us(next));
+	return us;
+}
 
-// Yield the current CPU to another ready process.
-// Called while handling a timer interrupt.
+// Set this CPU's timer to tick for the process running here, if any,
+// if it has other ready processes here to take turns with,
+// and turn the ticks off if it has the CPU to itself.
+// Ticks start again when proc_enqueue() gives it company.
+// While real-time processes are about, the timer enforces their schedule.
+// While a reschedule IPI is pending, the timer goes off soon to act on it.
+void
+proc_settick(void)
+{
+	cpu *c = cpu_cur();
+	proc *p = c->proc;
+	if (p == NULL || p->runcpu != c)
+		return;		// idle: proc_sched() sets the timer
+	if (c->resched) {
+		lapic_settick(LAPIC_TICK_MIN);
+		return;
+	}
+
+	uint32_t us = p->sv.sched.quantum ? p->sv.sched.quantum
+			: LAPIC_TICK_US;
+	if (p->rtcpu != NULL || c->runq.rtlen != 0) {
+		lapic_settick(proc_rt_tick(c, p, us));
+		return;
+	}
+
+	if (c->runq.len == 0 && c->runnext == NULL && c->gangnext == NULL) {
+		// The barrier orders our tickus update before our check
+		// of the queue, as proc_enqueue() orders its append before
+		// checking our tickus: so either it sees our ticks off
+		// and sends us an IPI, or we see its process.
+		lapic_settick(0);
+		membar();
+		if (c->runq.len == 0)
+			return;
+	}
+	lapic_settick(us);
+}
+
+
+// Switch from the current process to the best ready process
+// of priority 'maxprio' or higher, if there is one.
+// Any real-time process is better than a best-effort one;
+// a real-time current process only gives way to an earlier deadline,
+// until its budget runs out.
 void gcc_noreturn
-proc_yield(trapframe *tf)
+proc_switch(trapframe *tf, int maxprio)
 {
-	//panic("proc_yield not implemented");
+	// A child in our handoff slot whose parent didn't wait for it
+	// takes its turn in the queue like any other ready process.
+	cpu *c = cpu_cur();
+	proc *p = c->runnext;
+	if (proc_takenext(c, p))
+		proc_enqueue(p);
+
+	// A real-time process out of budget waits for its next period,
+	// while anything else runs.
+	proc *cur = proc_cur();
+	uint64_t before = ~0ULL;
+	if (cur->rtcpu != NULL) {
+		uint64_t now = rdtsc();
+		proc_charge(cur, now);
+		proc_rt_renew(cur, now);
+		if (cur->rtleft == 0) {
+			cur->rtthrottle++;
+			proc_save(cur, tf, PROC_SYSCALL_COMPLETE);
+			proctrace(SCHEDEV_YIELD, cur);
+			proc_ready(cur);
+			proc_sched();
+		}
+		before = cur->rtdeadline;
+		maxprio = -1;
+	}
 
-	proc *run_now = ready_queue_pop(&redi_ku);
+	// A gang member sent to us by another CPU runs right away.
+	// Otherwise, only look at our own queue: CPUs with nothing to do
+	// will steal from it, but a busy CPU has no business taking work.
+	proc *run_now = proc_takegang(c);
+	if (run_now == NULL)
+		run_now = proc_rt_pop(c, before);
+	if (run_now == NULL)
+		run_now = ready_queue_pop(&c->runq, maxprio);
 	
 	if (run_now) {
-		proc *run_later = proc_cur();
+		proc *run_later = cur;
 		//cprintf("proc_yield: proc_cur: state=%d\n",run_later->state);
 		proc_save(run_later, tf, PROC_SYSCALL_COMPLETE);
+		proctrace(SCHEDEV_YIELD, run_later);
 		proc_ready(run_later);
 		proc_run(run_now);
 	}
 
+	proc_settick();
 	trap_return(tf);
 }
 
+// Yield the current CPU to a ready process of higher priority, if any,
+// or to any ready process if the current one's gang is being stopped.
+// Called while handling an interrupt from user mode.
+void gcc_noreturn
+proc_yield(trapframe *tf)
+{
+	//panic("proc_yield not implemented");
+	cpu *c = cpu_cur();
+	proc *p = proc_cur();
+	c->resched = false;
+	proc_gang *g = c->gangstop;
+	if (g != NULL) {
+		c->gangstop = NULL;
+		if (g == p->gang)
+			proc_switch(tf, PROC_NPRIO-1);
+	}
+	proc_switch(tf, p->prio - 1);
+}
+
+// Charge a LAPIC timer tick to the current process, and preempt it
+// if its time slice is up or a process of higher priority is ready.
+// Called while handling a timer interrupt from user mode.
+void gcc_noreturn
+proc_tick(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+	proc *p = proc_cur();
+
+	// A tick set early to act on a reschedule IPI that came in
+	// while we were in the kernel just does what the IPI would have,
+	// without charging the process or counting towards a boost.
+	if (c->resched)
+		proc_yield(tf);
+
+	// Every so often, lift everyone on this CPU back to the top.
+	if (++c->ticks % PROC_BOOSTTICKS == 0) {
+		ready_queue_boost(&c->runq);
+		p->prio = 0;
+	}
+
+	// Real-time processes have budgets instead of time slices.
+	if (p->rtcpu != NULL)
+		proc_switch(tf, -1);
+
+	// A process that used up its slice goes down a level, and then
+	// takes turns with ready processes of its new level or higher.
+	// The rest of its gang, if any, gives up the CPU along with it.
+	if (++p->sliceticks < PROC_SLICE(p->prio))
+		proc_switch(tf, p->prio - 1);
+	p->sliceticks = 0;
+	if (p->prio < PROC_NPRIO-1)
+		p->prio++;
+	if (p->gang)
+		proc_gang_stop(p);
+	proc_switch(tf, p->prio);
+}
+
 
 
 // Put the current process to sleep by "returning" to its parent process.
@@ -191,7 +828,14 @@ proc_ret(trapframe *tf, int entry)
 	if (parent->waitchild == child) {
 		parent->waitchild = NULL;
 		proc_save(child, tf, entry);
+		proctrace(SCHEDEV_RET, child);
 		proc_mark(child, PROC_STOP);
+		if (!proc_allowed(parent, cpu_cur())
+				|| proc_rt_throttled(parent)) {
+			proc_ready(parent);
+			proc_sched();
+		}
+		proc_promote(parent);	// it blocked, and gets the CPU now
 		proc_run(parent);
 		}
 
@@ -203,11 +847,115 @@ proc_ret(trapframe *tf, int entry)
 void
 proc_mark(proc *p, proc_state state)
 {
+	// Account for the time the process spent running.
+	if (p->state == PROC_RUN && state != PROC_RUN)
+		proc_charge(p, rdtsc());
+	else if (state == PROC_RUN && p->state != PROC_RUN)
+		p->runstart = rdtsc();
+
 	p->state = state;
 	p->runcpu = NULL;
 	if (state == PROC_RUN) {
-		p->runcpu = cpu_cur();
-		p->runcpu->proc = p;
+		cpu *c = cpu_cur();
+		c->nrun++;
+		p->nrun++;
+		if (p->lastcpu != NULL && p->lastcpu != c)
+			c->nmigrate++;
+		p->runcpu = p->lastcpu = c;
+		c->proc = p;
+	}
+}
+
+// Add process p and its descendants to a statistics snapshot,
+// as far as there's room.
+static void
+proc_stat_proc(schedstat *ss, proc *p, int slot)
+{
+	if (ss->nproc == SCHEDSTAT_MAXPROC)
+		return;
+	schedstat_proc *sp = &ss->proc[ss->nproc++];
+	sp->id = (uint32_t) p;
+	sp->parent = (uint32_t) p->parent;
+	sp->child = slot;
+	sp->state = p->state;
+	sp->nrun = p->nrun;
+	sp->gang = p->gang != NULL ? p->gang->id : 0;
+	sp->rtmiss = p->rtmiss;
+	sp->rtthrottle = p->rtthrottle;
+	sp->runtime = p->runtime;
+
+	int i;
+	for (i = 0; i < PROC_CHILDREN; i++)
+		if (p->child[i] != NULL)
+			proc_stat_proc(ss, p->child[i], i);
+}
+
+void
+proc_stat(schedstat *ss)
+{
+	cpu *c;
+
+	// Other CPUs' counters may be changing under us: that's OK.
+	memset(ss, 0, sizeof(*ss));
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		assert(c->num < SCHEDSTAT_MAXCPU);
+		schedstat_cpu *sc = &ss->cpu[c->num];
+		sc->nqueued = c->runq.len;
+		sc->nrun = c->nrun;
+		sc->nmigrate = c->nmigrate;
+		sc->ntick = c->ticks;
+		sc->rtutil = c->rtutil;
+		sc->rtmiss = c->rtmiss;
+		ss->ncpu = MAX(ss->ncpu, c->num + 1);
+	}
+	proctrace_stat(ss);
+	ss->tschz = pit_tschz;
+
+	// Running processes' runtimes don't include their current runs.
+	if (proc_root != NULL)
+		proc_stat_proc(ss, proc_root, 0);
+}
+
+void
+proc_stat_print(const schedstat *ss)
+{
+	uint32_t lat[SCHEDSTAT_NLAT];
+	int i, b, last = 0;
+
+	memset(lat, 0, sizeof(lat));
+	for (i = 0; i < ss->ncpu; i++) {
+		const schedstat_cpu *sc = &ss->cpu[i];
+		cprintf("sched: cpu %d: %d queued, %d switches, "
+			"%d migrated in, %d ticks\n", i, sc->nqueued,
+			sc->nrun, sc->nmigrate, sc->ntick);
+		if (sc->rtutil != 0 || sc->rtmiss != 0)
+			cprintf("sched: cpu %d: %d.%d%% real-time, "
+				"%d deadlines missed\n", i, sc->rtutil / 10000,
+				sc->rtutil / 1000 % 10, sc->rtmiss);
+		for (b = 0; b < SCHEDSTAT_NLAT; b++) {
+			lat[b] += sc->lat[b];
+			if (lat[b])
+				last = b;
+		}
+	}
+
+	// Show the latency histogram up to its last nonempty bucket.
+	cprintf("sched: wakeup latency:");
+	for (b = 0; b <= last; b++)
+		cprintf(" %s%dus:%d", b < SCHEDSTAT_NLAT-1 ? "<" : ">=",
+			1 << (b < SCHEDSTAT_NLAT-1 ? b : b-1), lat[b]);
+	cprintf("\n");
+
+	uint64_t khz = MAX(pit_tschz / 1000, 1);
+	for (i = 0; i < ss->nproc; i++) {
+		const schedstat_proc *sp = &ss->proc[i];
+		cprintf("sched: proc %x parent %x state %d: %d runs, "
+			"%lld ms\n", sp->id, sp->parent, sp->state,
+			sp->nrun, sp->runtime / khz);
+		if (sp->rtmiss != 0 || sp->rtthrottle != 0)
+			cprintf("sched: proc %x: %d deadlines missed, "
+				"%d periods out of budget\n", sp->id,
+				sp->rtmiss, sp->rtthrottle);
 	}
 }
 
@@ -216,11 +964,17 @@ proc_mark(proc *p, proc_state state)
 static void child(int n);
 static void child_original(int n);
 static void grandchild(int n);
+static void gangchild(int n);
+static void rtchild(void);
+static const schedstat_proc *check_statproc(int slot);
+static int check_gangsize(uint32_t gang);
 
 static struct procstate child_state;
 static char gcc_aligned(16) child_stack[4][PAGESIZE];
 
 static volatile uint32_t pingpong = 0;
+static volatile uint64_t rtstop = 0;	// TSC when rtchild()ren stop spinning
+static schedstat check_ss;		// Statistics snapshots to check
 static void *recovargs;
 
 
@@ -295,6 +1049,95 @@ proc_check(void)
 
 	cprintf("proc_check() trap reflection test succeeded\n");
 
+	// Run the 4-child pingpong test again with the children in a gang,
+	// so they can get the CPUs at the same time instead of spinning
+	// out whole time slices waiting for each other.
+	procsched *ps = &child_state.sched;
+	pingpong = 0;
+	for (i = 0; i < 4; i++) {
+		uint32_t *esp = (uint32_t*) &child_stack[i][PAGESIZE];
+		*--esp = i;	// push argument to gangchild() function
+		*--esp = 0;	// fake return address
+		child_state.tf.eip = (uint32_t) gangchild;
+		child_state.tf.esp = (uint32_t) esp;
+		ps->gang = 1;
+		sys_put(SYS_REGS | SYS_SCHED, i, &child_state, NULL, NULL, 0);
+		ps->gang = 0;
+		sys_get(SYS_SCHED, i, &child_state, NULL, NULL, 0);
+		assert(ps->gang == 1);
+	}
+	assert(check_gangsize(1) == 4);
+	for (i = 0; i < 4; i++)
+		sys_put(SYS_START, i, NULL, NULL, NULL, 0);
+	for (i = 0; i < 4; i++)
+		sys_get(0, i, NULL, NULL, NULL, 0);
+
+	// Gang 0 takes the children back out, and the last one out
+	// frees the gang.
+	ps->gang = 0;
+	for (i = 3; i >= 0; i--) {
+		sys_put(SYS_SCHED, i, &child_state, NULL, NULL, 0);
+		assert(check_gangsize(1) == i);
+	}
+	cprintf("proc_check() gang pingpong test succeeded\n");
+
+	// A real-time reservation is admitted if it fits and can be enforced,
+	// and refused, leaving the child best-effort, if not.
+	child_state.tf.eip = (uint32_t) rtchild;
+	child_state.tf.esp = (uint32_t) &child_stack[0][PAGESIZE];
+	ps->period = 10000;
+	ps->budget = 1000;
+	sys_put(SYS_REGS | SYS_SCHED | SYS_START, 4, &child_state,
+		NULL, NULL, 0);
+	sys_get(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	assert(ps->period == 10000 && ps->budget == 1000);
+	ps->budget = 20000;		// more than its period
+	sys_put(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	sys_get(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	assert(ps->period == 0 && ps->budget == 0);
+	ps->period = ps->budget = 10000;	// more than PROC_RT_MAXUTIL
+	sys_put(SYS_SCHED | SYS_START, 4, &child_state, NULL, NULL, 0);
+	sys_get(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	assert(ps->period == 0 && ps->budget == 0);
+	cprintf("proc_check() real-time admission test succeeded\n");
+
+	// A real-time child spinning for 50ms with a budget of half its CPU
+	// is stopped when its budget runs out each period, so a best-effort
+	// sibling on the same CPU gets to run in between.
+	// With only that sibling to compete with, it shouldn't miss deadlines,
+	// but timer jitter under emulation might make it: just report those.
+	ps->affinity = 1;		// both on CPU 0
+	ps->period = 10000;
+	ps->budget = 5000;
+	sys_put(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	sys_get(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	assert(ps->period == 10000 && ps->budget == 5000);
+	ps->period = ps->budget = 0;
+	child_state.tf.eip = (uint32_t) rtchild;
+	child_state.tf.esp = (uint32_t) &child_stack[1][PAGESIZE];
+	sys_put(SYS_REGS | SYS_SCHED, 5, &child_state, NULL, NULL, 0);
+
+	sys_stat(0, STAT_SCHED, &check_ss);
+	uint32_t throttled = check_statproc(4)->rtthrottle;
+	uint32_t missed = check_statproc(4)->rtmiss;
+	uint64_t beruntime = check_statproc(5)->runtime;
+	rtstop = rdtsc() + check_ss.tschz / 1000 * 50;
+	sys_put(SYS_START, 4, NULL, NULL, NULL, 0);
+	sys_put(SYS_START, 5, NULL, NULL, NULL, 0);
+	sys_get(0, 4, NULL, NULL, NULL, 0);
+	sys_get(0, 5, NULL, NULL, NULL, 0);
+	sys_stat(0, STAT_SCHED, &check_ss);
+	assert(check_statproc(4)->rtthrottle > throttled);
+	assert(check_statproc(5)->runtime > beruntime);
+	cprintf("proc_check: real-time child missed %d deadlines\n",
+		check_statproc(4)->rtmiss - missed);
+
+	// Give back the reservation.
+	ps->affinity = 0;
+	sys_put(SYS_SCHED, 4, &child_state, NULL, NULL, 0);
+	sys_put(SYS_SCHED, 5, &child_state, NULL, NULL, 0);
+	cprintf("proc_check() real-time budget test succeeded\n");
+
 	cprintf("proc_check() succeeded!\n");
 }
 
@@ -345,3 +1188,183 @@ static void grandchild(int n)
 	panic("grandchild(): shouldn't have gotten here");
 }
 
+// Round-robin pingpong between the 4 children again, as a gang.
+static void
+gangchild(int n)
+{
+	int i;
+	for (i = 0; i < 10; i++) {
+		cprintf("in gang child %d count %d\n", n, i);
+		while (pingpong != n)
+			pause();
+		xchg(&pingpong, (pingpong + 1) % 4);
+	}
+	sys_ret();
+
+	panic("gangchild(): shouldn't have gotten here");
+}
+
+// Spin until rtstop each time we're started, then return to our parent.
+static void
+rtchild(void)
+{
+	for (;;) {
+		while (rdtsc() < rtstop)
+			pause();
+		sys_ret();
+	}
+}
+
+// Count our children in a gang, as the kernel reports them.
+static int
+check_gangsize(uint32_t gang)
+{
+	int i, n = 0;
+	sys_stat(0, STAT_SCHED, &check_ss);
+	for (i = 1; i < check_ss.nproc; i++)
+		if (check_ss.proc[i].parent == check_ss.proc[0].id
+				&& check_ss.proc[i].gang == gang)
+			n++;
+	return n;
+}
+
+// Find our child in a given slot in the latest statistics snapshot.
+static const schedstat_proc *
+check_statproc(int slot)
+{
+	int i;
+	for (i = 1; i < check_ss.nproc; i++)
+		if (check_ss.proc[i].parent == check_ss.proc[0].id
+				&& check_ss.proc[i].child == slot)
+			return &check_ss.proc[i];
+	panic("check_statproc: child %d not in snapshot", slot);
+}
+
+
+// Children for proc_bench(), which return to their parent whenever started:
+// right away, after PROC_BENCH_WORK pause()s,
+// or after yielding the CPU PROC_BENCH_YIELDS times.
+static void
+bench_child(void)
+{
+	for (;;)
+		sys_ret();
+}
+
+static void
+bench_worker(void)
+{
+	int i;
+	for (;;) {
+		for (i = 0; i < PROC_BENCH_WORK; i++)
+			pause();
+		sys_ret();
+	}
+}
+
+static void
+bench_yielder(void)
+{
+	int i;
+	for (;;) {
+		for (i = 0; i < PROC_BENCH_YIELDS; i++)
+			sys_yield();
+		sys_ret();
+	}
+}
+
+// Child slots for each benchmark: proc_check() uses the first few.
+#define BENCH_PINGPONG	(PROC_CHILDREN-1)
+#define BENCH_GROUP	16		// PROC_BENCH_NPROC fan-out/yield children
+#define BENCH_SPAWN	64		// Ring of BENCH_NSPAWN slots to spawn into
+#define BENCH_NSPAWN	128
+
+static char gcc_aligned(16) bench_stack[PROC_BENCH_NPROC][PAGESIZE];
+static int bench_nspawn;
+
+// Set up child 'slot' to run 'fn' on stack 'i', and optionally start it.
+static void
+bench_put(int slot, void (*fn)(void), int i, uint32_t flags)
+{
+	child_state.tf.eip = (uint32_t) fn;
+	child_state.tf.esp = (uint32_t) &bench_stack[i][PAGESIZE];
+	child_state.tf.cs = (uint32_t) CPU_GDT_UCODE+3;
+	child_state.tf.ss = (uint32_t) CPU_GDT_UDATA+3;
+	sys_put(SYS_REGS | flags, slot, &child_state, NULL, NULL, 0);
+}
+
+// One round of each benchmark.
+static void
+bench_pingpong(void)
+{
+	sys_put(SYS_START, BENCH_PINGPONG, NULL, NULL, NULL, 0);
+	sys_get(0, BENCH_PINGPONG, NULL, NULL, NULL, 0);
+}
+
+static void
+bench_group(void)
+{
+	int i;
+	for (i = 0; i < PROC_BENCH_NPROC; i++)
+		sys_put(SYS_START, BENCH_GROUP + i, NULL, NULL, NULL, 0);
+	for (i = 0; i < PROC_BENCH_NPROC; i++)
+		sys_get(0, BENCH_GROUP + i, NULL, NULL, NULL, 0);
+}
+
+static void
+bench_spawn(void)
+{
+	int slot = BENCH_SPAWN + bench_nspawn++ % BENCH_NSPAWN;
+	bench_put(slot, bench_child, 0, SYS_START);
+	sys_get(0, slot, NULL, NULL, NULL, 0);
+}
+
+// Time rounds of a benchmark for PROC_BENCH_MS milliseconds,
+// and report it as 'opsper' operations per round involving 'nproc' children.
+static void
+bench_time(const char *op, int nproc, int opsper, void (*round)(void))
+{
+	uint64_t window = pit_tschz ? pit_tschz / 1000 * PROC_BENCH_MS
+				: (uint64_t) PROC_BENCH_MS * 1000000;
+	uint64_t start = rdtsc(), cycles;
+	uint64_t ops = 0;
+	do {
+		round();
+		ops += opsper;
+	} while ((cycles = rdtsc() - start) < window);
+
+	cprintf("procbench: ncpu=%d op=%s cpu=all nproc=%d ops=%lld "
+		"cyc/op=%lld ops/s=%lld\n", ismp ? ncpu : 1, op, nproc, ops,
+		cycles / ops, bench_persec(ops, cycles));
+}
+
+// Measure how fast the root process can get work done by its children:
+//	pingpong	start one child with PUT and wait for it with GET,
+//			which returns right away: one op per round trip
+//	fanout		start PROC_BENCH_NPROC children doing a little work
+//			each, then wait for them all: one op per child
+//	yield		as fanout, but the children yield the CPU
+//			PROC_BENCH_YIELDS times each: one op per yield
+//	spawn		load a child's registers from scratch, start it,
+//			and wait for it: one op per child, each time
+//			in the next of a ring of slots
+// Runs in user mode, as the root process, after proc_check().
+void
+proc_bench(void)
+{
+	int i;
+
+	bench_put(BENCH_PINGPONG, bench_child, 0, 0);
+	bench_time("pingpong", 1, 1, bench_pingpong);
+
+	for (i = 0; i < PROC_BENCH_NPROC; i++)
+		bench_put(BENCH_GROUP + i, bench_worker, i, 0);
+	bench_time("fanout", PROC_BENCH_NPROC, PROC_BENCH_NPROC, bench_group);
+
+	for (i = 0; i < PROC_BENCH_NPROC; i++)
+		bench_put(BENCH_GROUP + i, bench_yielder, i, 0);
+	bench_time("yield", PROC_BENCH_NPROC,
+		PROC_BENCH_NPROC * PROC_BENCH_YIELDS, bench_group);
+
+	bench_time("spawn", 1, 1, bench_spawn);
+}
@@ -23,6 +23,77 @@
 #define	PROC_SYSCALL_COMPLETE	1
 #define	PROC_TRAP_REFLECT		-1
 
+// Processes are scheduled by a multi-level feedback queue.
+// A process runs for up to PROC_SLICE(prio) LAPIC timer ticks at a time,
+// and is preempted early if a process of higher priority becomes ready.
+// A process that uses up its whole slice is demoted a level,
+// and one that blocks before its slice is up is promoted a level,
+// so interactive and short-running processes rise above CPU hogs.
+// Every PROC_BOOSTTICKS ticks each CPU lifts all its processes to level 0,
+// so that demoted processes can't starve.
+#define PROC_NPRIO		4		// Priority levels; 0 is highest
+#define PROC_SLICE(prio)	(1 << (prio))	// Time slice in ticks
+#define PROC_BOOSTTICKS		32		// Ticks between boosts
+
+// A newly started child waits in its parent's CPU's handoff slot
+// (see proc_handoff()) for up to PROC_HANDOFF_US microseconds
+// before a CPU with nothing else to do may steal it.
+#define PROC_HANDOFF_US		5
+
+// A process that becomes ready goes back to the CPU it last ran on,
+// where its working set may still be cached, unless that CPU's ready queue
+// is more than PROC_IMBALANCE longer than the current CPU's.
+// A process's procsched.affinity mask, if nonzero, restricts it
+// to a set of CPUs regardless.
+#define PROC_IMBALANCE		2
+
+// Sibling processes with the same nonzero procsched.gang form a gang,
+// which the scheduler runs as a unit as far as it has the CPUs to:
+// when a member starts running, its ready siblings are pulled off
+// their ready queues and handed to other CPUs to run at the same time,
+// idle ones first, then ones running processes outside the gang;
+// and when a member's time slice runs out, the rest are preempted with it.
+// This keeps members that synchronize closely from waiting out
+// whole time slices for each other.
+typedef struct proc_gang {
+	uint32_t	id;		// Members' procsched.gang
+	int		nmember;	// Number of members
+	struct proc	*members;	// Chained through proc.gangpeer
+} proc_gang;
+
+// A process given a real-time period and budget with SYS_SCHED
+// gets up to 'budget' microseconds of CPU time in each 'period',
+// by the end of that period, its deadline.
+// Real-time processes run ahead of all others, earliest deadline first,
+// each on one CPU it is assigned to when its reservation is admitted:
+// the one allowed by its affinity mask with the least reserved,
+// as long as that leaves its reservations within PROC_RT_MAXUTIL
+// percent of its time, so that EDF can meet all of their deadlines
+// and leave time for the rest.  Budgets are enforced with the LAPIC timer:
+// a process that uses up its budget waits for its next period.
+// A process that blocks before using its budget keeps the rest
+// until its deadline, and starts a new period when it wakes after that.
+// One still wanting to run with budget left at its deadline
+// counts a deadline miss (see inc/kstat.h).
+#define PROC_RT_MAXUTIL		90	// Percent of each CPU to reserve
+
+// Parameters for proc_bench(), which runs when built with 'make BENCH=1'.
+// Each of its benchmarks runs for PROC_BENCH_MS milliseconds,
+// the fan-out and yield benchmarks with PROC_BENCH_NPROC children
+// doing PROC_BENCH_WORK pause()s or PROC_BENCH_YIELDS yields each time.
+#ifndef PROC_BENCH_MS
+#define PROC_BENCH_MS		200
+#endif
+#ifndef PROC_BENCH_NPROC
+#define PROC_BENCH_NPROC	8
+#endif
+#ifndef PROC_BENCH_WORK
+#define PROC_BENCH_WORK		1000
+#endif
+#ifndef PROC_BENCH_YIELDS
+#define PROC_BENCH_YIELDS	100
+#endif
+
 typedef enum proc_state {
 	PROC_STOP	= 0,	// Passively waiting for parent to run it
 	PROC_READY,		// Scheduled to run but not running now
@@ -31,7 +102,7 @@ typedef enum proc_state {
 } proc_state;
 
 // Thread control block structure.
-// Consumes 1 physical memory page, though we don't use all of it.
+// Allocated from a kmem_cache (see kern/kmem.h), several to a page.
 typedef struct proc {
 
 	// Master spinlock protecting proc's state.
@@ -44,8 +115,28 @@ typedef struct proc {
 	// Scheduling state for this process.
 	proc_state	state;		// current state
 	struct proc	*readynext;	// chain on ready queue
+	struct ready_queue *readyq;	// ready queue we're on, if any
 	struct cpu	*runcpu;	// cpu we're running on if running
+	struct cpu	*lastcpu;	// cpu we last ran on, NULL if never
 	struct proc	*waitchild;	// child proc if waiting for child
+	int		prio;		// MLFQ priority level, 0 highest
+	int		sliceticks;	// timer ticks used in this slice
+	uint64_t	runtime;	// total TSC cycles spent running
+	uint64_t	runstart;	// TSC when last put in run state
+	uint64_t	readyat;	// TSC when woken, until run (proctrace)
+	uint32_t	nrun;		// times put in run state
+	proc_gang	*gang;		// gang we belong to, if any
+	struct proc	*gangpeer;	// next member of our gang
+
+	// Real-time scheduling state, if sv.sched gives a period and budget.
+	struct cpu	*rtcpu;		// cpu we're bound to, NULL if not RT
+	uint64_t	rtperiod;	// period in TSC cycles
+	uint64_t	rtbudget;	// CPU time allowed each period, in cycles
+	uint64_t	rtdeadline;	// TSC when the current period ends
+	uint64_t	rtleft;		// budget left in the current period
+	uint32_t	rtutil;		// share of rtcpu reserved, in millionths
+	uint32_t	rtmiss;		// deadlines missed
+	uint32_t	rtthrottle;	// periods in which we used up our budget
 
 	// Save area for user-visible state when process is not running.
 	procstate	sv;
@@ -64,13 +155,25 @@ extern proc *proc_root;
 void proc_init(void);	// Initialize process management code
 proc *proc_alloc(proc *p, uint32_t cn);	// Allocate new child
 void proc_ready(proc *p);	// Make process p ready
+void proc_handoff(proc *p);	// Make a just-started child ready
+bool proc_setgang(proc *p, uint32_t id);	// Join or leave a gang
+bool proc_setrt(proc *p);	// Admit real-time parameters in p->sv.sched
 void proc_save(proc *p, trapframe *tf, int entry);	// save process state
 void proc_wait(proc *p, proc *cp, trapframe *tf) gcc_noreturn;
 void proc_sched(void) gcc_noreturn;	// Find and run some ready process
 void proc_run(proc *p) gcc_noreturn;	// Run a specific process
-void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to another process
+void proc_settick(void);	// Start or stop timer ticks as needed
+void proc_switch(trapframe *tf, int maxprio) gcc_noreturn; // Yield
+void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to higher priority
+void proc_tick(trapframe *tf) gcc_noreturn;	// Handle a timer tick
 void proc_ret(trapframe *tf, int entry) gcc_noreturn;	// Return to parent
 void proc_check(void);			// Check process code
+void proc_bench(void);			// Benchmark process switching
+
+// Take a snapshot of the scheduler statistics, and print one.
+struct schedstat;
+void proc_stat(struct schedstat *ss);
+void proc_stat_print(const struct schedstat *ss);
 void proc_mark(proc*, proc_state);
 
 
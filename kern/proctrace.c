@@ -0,0 +1,109 @@
+/*
+ * Scheduler event tracing.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/proc.h>
+#include <kern/proctrace.h>
+
+#include <dev/pit.h>
+
+
+// Each CPU's event ring and latency histogram,
+// padded out so CPUs don't share cache lines.
+typedef struct proctrace_cpu {
+	uint32_t	next;			// Events ever recorded
+	schedevent	ev[PROCTRACE_NEVENT];	// The latest of them
+	uint32_t	lat[SCHEDSTAT_NLAT];	// Wakeup latency histogram
+} gcc_aligned(64) proctrace_cpu;
+
+static proctrace_cpu proctrace_cpus[CPU_MAX];
+
+static const char *proctrace_typename[] = {
+	"?", "ready", "run", "yield", "wait", "ret", "miss",
+};
+
+
+void
+proctrace_(int type, proc *p)
+{
+	proctrace_cpu *t = &proctrace_cpus[cpu_cur()->num];
+	uint64_t now = rdtsc();
+	schedevent *e = &t->ev[t->next++ % PROCTRACE_NEVENT];
+	e->tsc = now;
+	e->proc = (uint32_t) p;
+	e->type = type;
+
+	// Time how long a woken process waits to get a CPU.
+	if (type == SCHEDEV_READY)
+		p->readyat = now;
+	else if (type == SCHEDEV_RUN && p->readyat != 0) {
+		uint64_t us = pit_tschz ? (now - p->readyat) * 1000000
+						/ pit_tschz : 0;
+		int b = 0;
+		while (us != 0 && b < SCHEDSTAT_NLAT-1) {
+			us >>= 1;
+			b++;
+		}
+		t->lat[b]++;
+		p->readyat = 0;
+	}
+}
+
+void
+proctrace_stat(schedstat *ss)
+{
+	int i, b;
+	for (i = 0; i < ss->ncpu; i++)
+		for (b = 0; b < SCHEDSTAT_NLAT; b++)
+			ss->cpu[i].lat[b] = proctrace_cpus[i].lat[b];
+}
+
+void
+proctrace_get(schedtrace *st)
+{
+	cpu *c;
+
+	memset(st, 0, sizeof(*st));
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		assert(c->num < SCHEDSTAT_MAXCPU);
+		proctrace_cpu *t = &proctrace_cpus[c->num];
+		uint32_t next = t->next, n = MIN(next, SCHEDTRACE_NEVENT);
+		uint32_t i;
+		for (i = 0; i < n; i++)
+			st->event[c->num][i] =
+				t->ev[(next - n + i) % PROCTRACE_NEVENT];
+		st->nevent[c->num] = n;
+		st->ncpu = MAX(st->ncpu, c->num + 1);
+	}
+}
+
+void
+proctrace_print(const schedtrace *st)
+{
+	int i, j;
+
+	// Show times in microseconds since the oldest event on any CPU.
+	uint64_t t0 = ~0ULL;
+	for (i = 0; i < st->ncpu; i++)
+		if (st->nevent[i] > 0)
+			t0 = MIN(t0, st->event[i][0].tsc);
+	uint64_t mhz = MAX(pit_tschz / 1000000, 1);
+
+	for (i = 0; i < st->ncpu; i++)
+		for (j = 0; j < st->nevent[i]; j++) {
+			const schedevent *e = &st->event[i][j];
+			cprintf("trace: cpu %d %lldus proc %x %s\n", i,
+				(e->tsc - t0) / mhz, e->proc,
+				proctrace_typename[e->type <= SCHEDEV_MISS
+							? e->type : 0]);
+		}
+}
@@ -0,0 +1,51 @@
+/*
+ * Scheduler event tracing.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_PROCTRACE_H
+#define PIOS_KERN_PROCTRACE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/kstat.h>
+
+
+// With PROC_TRACE=1, the default, the scheduler records each time
+// a process is woken, run, preempted, blocks, returns
+// or misses a real-time deadline (SCHEDEV_*
+// in inc/kstat.h) with a TSC timestamp in a ring of the latest
+// PROCTRACE_NEVENT events kept by each CPU, and counts wakeup-to-run
+// latencies in a histogram per CPU.  Each event costs an rdtsc and
+// a few stores to memory only the CPU itself writes.
+// Build with 'make DEFS=-DPROC_TRACE=0' to leave the tracepoints out.
+//
+// Tracepoints are only hit in system calls and in interrupts from user
+// mode, which can't interrupt each other, so each CPU's ring needs
+// no locking; readers on other CPUs just get a slightly stale snapshot.
+#ifndef PROC_TRACE
+#define PROC_TRACE		1
+#endif
+#define PROCTRACE_NEVENT	128	// Events kept per CPU: a power of 2
+
+struct proc;
+
+#define proctrace(type, p)	\
+	do { if (PROC_TRACE) proctrace_(type, p); } while (0)
+
+// Record a scheduler event of a given type involving process p.
+void proctrace_(int type, struct proc *p);
+
+// Add the wakeup latency histograms to a scheduler statistics snapshot.
+void proctrace_stat(schedstat *ss);
+
+// Take a snapshot of the latest events on each CPU, and print one.
+void proctrace_get(schedtrace *st);
+void proctrace_print(const schedtrace *st);
+
+
+#endif // !PIOS_KERN_PROCTRACE_H
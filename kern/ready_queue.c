@@ -1,40 +1,211 @@
 #include  <kern/ready_queue.h>
+#include  <kern/proc.h>
+#include  <inc/string.h>
 #include  <inc/x86.h>
+#include  <inc/assert.h>
 
 void
 ready_queue_init(ready_queue *q) {
-	q->head = q->tail = &q->dummy;
+	memset(q->head, 0, sizeof(q->head));
+	memset(q->tail, 0, sizeof(q->tail));
+	q->len = 0;
+	q->rthead = NULL;
+	q->rtlen = 0;
 	spinlock_init(&q->lock);
 }
 
 void
 ready_queue_append(ready_queue *q, proc *p)
 {
-	//panic("proc_ready not implemented");
+	int l = p->prio;
+	p->readynext = NULL;
 
 	spinlock_acquire(&q->lock);
-	q->tail->readynext = p;		//add to end of queue
-	q->tail = p;				//slide on down
+	p->readyq = q;
+	if (p->rtcpu != NULL) {			//real-time: sort by deadline
+		proc **pp = &q->rthead;
+		while (*pp != NULL && (*pp)->rtdeadline <= p->rtdeadline)
+			pp = &(*pp)->readynext;
+		p->readynext = *pp;
+		*pp = p;
+		q->rtlen++;
+		spinlock_release(&q->lock);
+		return;
+	}
+	if (q->head[l] == NULL)			//is list empty?
+		q->head[l] = p;
+	else
+		q->tail[l]->readynext = p;	//add to end of list
+	q->tail[l] = p;				//slide on down
+	q->len++;
 	spinlock_release(&q->lock);
 }
 
 proc*
-ready_queue_pop(ready_queue *q)
+ready_queue_pop(ready_queue *q, int maxprio)
 {
-	//panic("proc_sched not implemented");
+	if (q->len == 0 || maxprio < 0)		//don't bother locking
+		return NULL;
+
+	proc *p = NULL;
+	int l;
 	spinlock_acquire(&q->lock);
-	if (q->head == q->tail) {		//is queue empty?
-		spinlock_release(&q->lock);
+	for (l = 0; l <= maxprio; l++) {
+		p = q->head[l];			//first process in list
+		if (p != NULL) {
+			q->head[l] = p->readynext;	//remove it from list
+			q->len--;
+			p->readyq = NULL;
+			break;
+		}
+	}
+	spinlock_release(&q->lock);
+	return p;
+}
+
+proc*
+ready_queue_steal(ready_queue *q, int cpunum)
+{
+	if (q->len == 0)			//don't bother locking
 		return NULL;
+
+	proc *p = NULL, *prev;
+	int l;
+	spinlock_acquire(&q->lock);
+	for (l = 0; l < PROC_NPRIO && p == NULL; l++) {
+		for (prev = NULL, p = q->head[l]; p != NULL;
+				prev = p, p = p->readynext) {
+			uint32_t mask = p->sv.sched.affinity;
+			if (mask == 0 || (mask & (1 << cpunum)))
+				break;
+		}
+		if (p == NULL)
+			continue;
+		if (prev == NULL)		//unlink it from its list
+			q->head[l] = p->readynext;
+		else
+			prev->readynext = p->readynext;
+		if (q->tail[l] == p)
+			q->tail[l] = prev;
+		q->len--;
+		p->readyq = NULL;
+	}
+	spinlock_release(&q->lock);
+	return p;
+}
+
+bool
+ready_queue_remove(ready_queue *q, proc *p)
+{
+	proc *prev = NULL, *r;
+	spinlock_acquire(&q->lock);
+	if (p->readyq != q) {			//someone took it first
+		spinlock_release(&q->lock);
+		return false;
+	}
+	int l = p->prio;			//a boost may have just changed it
+	if (p->rtcpu != NULL) {
+		proc **pp = &q->rthead;
+		while (*pp != p)
+			pp = &(*pp)->readynext;
+		*pp = p->readynext;
+		q->rtlen--;
+		p->readyq = NULL;
+		spinlock_release(&q->lock);
+		return true;
+	}
+	for (r = q->head[l]; r != p; prev = r, r = r->readynext)
+		assert(r != NULL);
+	if (prev == NULL)			//unlink it from its list
+		q->head[l] = p->readynext;
+	else
+		prev->readynext = p->readynext;
+	if (q->tail[l] == p)
+		q->tail[l] = prev;
+	q->len--;
+	p->readyq = NULL;
+	spinlock_release(&q->lock);
+	return true;
+}
+
+void
+ready_queue_boost(ready_queue *q)
+{
+	int l;
+	spinlock_acquire(&q->lock);
+	for (l = 1; l < PROC_NPRIO; l++) {
+		proc *p = q->head[l];
+		if (p == NULL)
+			continue;
+
+		// Append the whole list to level 0's, keeping its order.
+		if (q->head[0] == NULL)
+			q->head[0] = p;
+		else
+			q->tail[0]->readynext = p;
+		q->tail[0] = q->tail[l];
+		q->head[l] = NULL;
+		for (; p != NULL; p = p->readynext)
+			p->prio = 0;
 	}
+	spinlock_release(&q->lock);
+}
 
-	proc *readynext = q->head->readynext;	//first process in queue
-	if (readynext == q->tail) {				//is queue length 1?
-		q->tail = q->head;					//queue is now empty
-	} else {
-		q->head->readynext = readynext->readynext;	//remove first process from queue
+proc*
+ready_queue_rtpop(ready_queue *q, uint64_t before)
+{
+	if (q->rtlen == 0)			//don't bother locking
+		return NULL;
+
+	proc **pp, *p;
+	spinlock_acquire(&q->lock);
+	for (pp = &q->rthead; (p = *pp) != NULL; pp = &p->readynext) {
+		if (p->rtdeadline >= before) {	//none early enough
+			p = NULL;
+			break;
+		}
+		if (p->rtleft > 0) {		//skip those out of budget
+			*pp = p->readynext;
+			q->rtlen--;
+			p->readyq = NULL;
+			break;
+		}
 	}
-	
 	spinlock_release(&q->lock);
-	return readynext;
-}
\ No newline at end of file
+	return p;
+}
+
+proc*
+ready_queue_rtexpired(ready_queue *q, uint64_t now)
+{
+	if (q->rtlen == 0)			//don't bother locking
+		return NULL;
+
+	proc *p;
+	spinlock_acquire(&q->lock);
+	p = q->rthead;				//earliest deadline comes first
+	if (p != NULL && p->rtdeadline <= now) {
+		q->rthead = p->readynext;
+		q->rtlen--;
+		p->readyq = NULL;
+	} else
+		p = NULL;
+	spinlock_release(&q->lock);
+	return p;
+}
+
+uint64_t
+ready_queue_rtdeadline(ready_queue *q, bool runnable)
+{
+	if (q->rtlen == 0)			//don't bother locking
+		return ~0ULL;
+
+	proc *p;
+	spinlock_acquire(&q->lock);
+	for (p = q->rthead; p != NULL; p = p->readynext)
+		if (!runnable || p->rtleft > 0)
+			break;
+	uint64_t deadline = p != NULL ? p->rtdeadline : ~0ULL;
+	spinlock_release(&q->lock);
+	return deadline;
+}
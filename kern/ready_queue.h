@@ -4,18 +4,62 @@
 # error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <kern/spinlock.h>
 #include <kern/proc.h>
 
 
+// Queue of ready processes, with a FIFO list for each priority level
+// chained through proc.readynext.
+// Each CPU has its own (see kern/cpu.h), which it pushes onto and pops
+// from locally; the lock is there for idle CPUs stealing from it,
+// and for gangs pulling their members off it (see kern/proc.h).
+// proc.readyq points to the queue a process is on, if any.
+// 'len' may be read without the lock, to find a queue worth stealing from.
+// Real-time processes go on a separate list sorted by deadline
+// (see kern/proc.h), which only the queue's own CPU takes from;
+// they aren't counted in 'len', so they aren't stolen either.
 typedef struct ready_queue {
-	proc *head, *tail;	//ready queue
-	spinlock lock;		//protects the ready queue
-	proc dummy;			//always at head of ready queue i.e., assert(head == &dummy)
+	spinlock	lock;			//protects the ready queue
+	struct proc	*head[PROC_NPRIO];	//first process, or NULL if empty
+	struct proc	*tail[PROC_NPRIO];	//last process, if not empty
+	volatile int	len;			//number of processes queued
+	struct proc	*rthead;		//real-time processes by deadline
+	volatile int	rtlen;			//number of those
 } ready_queue;
 
 
 void ready_queue_init(ready_queue*);
-void ready_queue_append(ready_queue*, proc*);
-proc* ready_queue_pop(ready_queue*);
+
+// Add a process to the tail of the list for its priority level,
+// or a real-time process after those with the same or earlier deadlines.
+void ready_queue_append(ready_queue*, struct proc*);
+
+// Remove and return the first process of the highest priority level
+// that is no lower than 'maxprio', or NULL if there isn't one.
+struct proc* ready_queue_pop(ready_queue*, int maxprio);
+
+// Remove and return the first process of the highest priority level
+// that is allowed to run on the CPU numbered 'cpunum',
+// or NULL if there isn't one.
+struct proc* ready_queue_steal(ready_queue*, int cpunum);
+
+// Remove process p from queue q, and return true,
+// if p is still on q; otherwise return false.
+bool ready_queue_remove(ready_queue*, struct proc*);
+
+// Move all queued processes up to priority level 0.
+void ready_queue_boost(ready_queue*);
+
+// Remove and return the real-time process with the earliest deadline
+// before 'before' that has budget left, or NULL if there isn't one.
+struct proc* ready_queue_rtpop(ready_queue*, uint64_t before);
+
+// Remove and return a real-time process whose deadline is no later
+// than 'now', or NULL if there isn't one.
+struct proc* ready_queue_rtexpired(ready_queue*, uint64_t now);
+
+// Return the earliest deadline of the queued real-time processes,
+// counting only those with budget left if 'runnable', or ~0 if none.
+uint64_t ready_queue_rtdeadline(ready_queue*, bool runnable);
 
 #endif // !PIOS_KERN_READYQUEUE_H
@@ -0,0 +1,153 @@
+/*
+ * Reader-writer spinlocks and sequence locks for read-mostly kernel data.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+
+#include <kern/cpu.h>
+#include <kern/rwlock.h>
+
+
+void
+rwlock_init_(rwlock *rw, const char *file, int line)
+{
+	memset(rw, 0, sizeof(*rw));
+	spinlock_init_(&rw->lock, file, line);
+}
+
+void
+rwlock_read_acquire(rwlock *rw)
+{
+	rwlock_reader *r = &rw->cpu[cpu_cur()->num];
+	for (;;) {
+		// The locked add orders our count before our check of 'writer',
+		// just as the writer's xchg orders 'writer' before its checks
+		// of our count: so at least one of us sees the other.
+		lockadd(&r->nread, 1);
+		if (!rw->writer || r->nread > 1)
+			return;		// no writer, or we already read-hold it
+
+		// Let the writer in, and wait for it to finish.
+		lockadd(&r->nread, -1);
+		while (rw->writer)
+			pause();
+	}
+}
+
+void
+rwlock_read_release(rwlock *rw)
+{
+	rwlock_reader *r = &rw->cpu[cpu_cur()->num];
+	debug_assert(r->nread > 0);
+	lockadd(&r->nread, -1);
+}
+
+void
+rwlock_write_acquire(rwlock *rw)
+{
+	debug_assert(rw->cpu[cpu_cur()->num].nread == 0);
+
+	spinlock_acquire(&rw->lock);
+	xchg(&rw->writer, 1);		// keep out new readers
+
+	// Wait for the readers already in to leave.
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		while (rw->cpu[c->num].nread != 0)
+			pause();
+}
+
+void
+rwlock_write_release(rwlock *rw)
+{
+	assert(rw->writer);
+	asm volatile("" : : : "memory");	// finish writes first
+	rw->writer = 0;
+	spinlock_release(&rw->lock);
+}
+
+
+void
+seqlock_init_(seqlock *sl, const char *file, int line)
+{
+	spinlock_init_(&sl->lock, file, line);
+	sl->seq = 0;
+}
+
+void
+seqlock_write_begin(seqlock *sl)
+{
+	spinlock_acquire(&sl->lock);
+	sl->seq++;
+	asm volatile("" : : : "memory");	// odd seq before the data
+}
+
+void
+seqlock_write_end(seqlock *sl)
+{
+	asm volatile("" : : : "memory");	// the data before even seq
+	sl->seq++;
+	spinlock_release(&sl->lock);
+}
+
+
+void
+rwlock_check(void)
+{
+	static rwlock rw;
+	static seqlock sl;
+	rwlock_reader *r;
+	uint32_t seq;
+
+	rwlock_init(&rw);
+	r = &rw.cpu[cpu_cur()->num];
+	assert(((uint32_t) r & (RWLOCK_LINESIZE-1)) == 0);
+	assert((uint32_t) &rw.cpu[1] - (uint32_t) &rw.cpu[0]
+		== RWLOCK_LINESIZE);
+
+	// Readers nest and don't take the writers' spinlock.
+	rwlock_read_acquire(&rw);
+	rwlock_read_acquire(&rw);
+	assert(r->nread == 2 && !rw.writer);
+	assert(!spinlock_holding(&rw.lock));
+	rwlock_read_release(&rw);
+	rwlock_read_release(&rw);
+	assert(r->nread == 0);
+
+	// A writer excludes other writers and keeps out readers.
+	rwlock_write_acquire(&rw);
+	assert(rw.writer && spinlock_holding(&rw.lock));
+	rwlock_write_release(&rw);
+	assert(!rw.writer && !spinlock_holding(&rw.lock));
+
+	// A reader that already holds the lock gets in even past a writer
+	// waiting for it, since the writer couldn't get in until it leaves.
+	rwlock_read_acquire(&rw);
+	rw.writer = 1;			// pretend a writer is waiting
+	rwlock_read_acquire(&rw);
+	assert(r->nread == 2);
+	rw.writer = 0;
+	rwlock_read_release(&rw);
+	rwlock_read_release(&rw);
+
+	// The sequence number is odd only during writes,
+	// and readers see when a write overlapped their read.
+	seqlock_init(&sl);
+	seq = seqlock_read_begin(&sl);
+	assert(seq == 0 && !seqlock_read_retry(&sl, seq));
+	seqlock_write_begin(&sl);
+	assert(sl.seq == 1 && spinlock_holding(&sl.lock));
+	assert(seqlock_read_retry(&sl, seq));
+	seqlock_write_end(&sl);
+	assert(sl.seq == 2 && !spinlock_holding(&sl.lock));
+	assert(seqlock_read_retry(&sl, seq));
+	seq = seqlock_read_begin(&sl);
+	assert(seq == 2 && !seqlock_read_retry(&sl, seq));
+
+	cprintf("rwlock_check() succeeded!\n");
+}
@@ -0,0 +1,100 @@
+/*
+ * Reader-writer spinlocks and sequence locks for read-mostly kernel data.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_RWLOCK_H
+#define PIOS_KERN_RWLOCK_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+
+
+// A reader-writer lock lets any number of CPUs read at once,
+// or one CPU write.  Each CPU counts its read locks in its own cache line,
+// so readers on different CPUs don't disturb each other at all;
+// the price is that a writer must look at every CPU's count,
+// and that each rwlock takes CPU_MAX cache lines.
+// Use them for a few global, read-mostly structures, not per-object.
+//
+// Waiting writers keep new readers out, so readers can't starve them.
+// A CPU may nest read locks, but must not take the write lock
+// while holding a read lock, and interrupt handlers must not take
+// the write lock of an rwlock that the interrupted code may be reading.
+#define RWLOCK_LINESIZE	64	// Cache line size to pad reader counts to
+
+typedef struct rwlock_reader {
+	volatile int32_t nread;		// Read locks this CPU holds
+} gcc_aligned(RWLOCK_LINESIZE) rwlock_reader;
+
+typedef struct rwlock {
+	spinlock	lock;		// Serializes writers
+	volatile uint32_t writer;	// A writer holds or wants the lock
+	rwlock_reader	cpu[CPU_MAX];	// Indexed by cpu.num
+} rwlock;
+
+#define rwlock_init(rw)		rwlock_init_(rw, __FILE__, __LINE__)
+
+void rwlock_init_(rwlock *rw, const char *file, int line);
+void rwlock_read_acquire(rwlock *rw);
+void rwlock_read_release(rwlock *rw);
+void rwlock_write_acquire(rwlock *rw);
+void rwlock_write_release(rwlock *rw);
+
+
+// A sequence lock protects small data that is read far more often
+// than it is written, such as statistics snapshots, without readers
+// writing to shared memory at all.  Writers serialize on a spinlock and
+// bump a sequence number before and after each update, so it's odd while
+// an update is in progress; a reader copies the data out optimistically
+// and retries if the sequence number shows a writer got in the way:
+//
+//	do {
+//		seq = seqlock_read_begin(&sl);
+//		copy = data;
+//	} while (seqlock_read_retry(&sl, seq));
+//
+// Readers may see inconsistent data before they retry,
+// so they must only copy it, not follow pointers in it.
+typedef struct seqlock {
+	spinlock	lock;		// Serializes writers
+	volatile uint32_t seq;		// Odd while a write is in progress
+} seqlock;
+
+#define seqlock_init(sl)	seqlock_init_(sl, __FILE__, __LINE__)
+
+void seqlock_init_(seqlock *sl, const char *file, int line);
+void seqlock_write_begin(seqlock *sl);
+void seqlock_write_end(seqlock *sl);
+
+static gcc_inline uint32_t
+seqlock_read_begin(seqlock *sl)
+{
+	uint32_t seq;
+	while ((seq = sl->seq) & 1)
+		pause();
+	asm volatile("" : : : "memory");	// read data after seq
+	return seq;
+}
+
+static gcc_inline bool
+seqlock_read_retry(seqlock *sl, uint32_t seq)
+{
+	asm volatile("" : : : "memory");	// read data before seq
+	return sl->seq != seq;
+}
+
+
+// Check the reader-writer and sequence locks.
+void rwlock_check(void);
+
+
+#endif // !PIOS_KERN_RWLOCK_H
@@ -11,23 +11,134 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/kstat.h>
 
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/cons.h>
+#include <kern/bench.h>
+#include <kern/mp.h>
 
+#include <dev/pit.h>
 
 
+bool spinlock_traceall = (PIOS_DEBUG >= 2);
+
+
+#if SPINLOCK_PROF
+// Contention counters for one init site, kept by each CPU
+// so that locks from the same site can be profiled concurrently.
+typedef struct spinlock_prof {
+	uint32_t	nacquire;
+	uint32_t	ncontended;
+	uint64_t	spincycles;
+	uint64_t	spinmax;
+	uint64_t	holdcycles;
+	uint64_t	holdmax;
+} spinlock_prof;
+
+typedef struct spinlock_site {
+	const char	*file;
+	int		line;
+	spinlock_prof	cpu[CPU_MAX];	// Indexed by cpu.num
+} spinlock_site;
+
+static spinlock_site spinlock_sites[SPINLOCK_PROF_SITES];
+static int spinlock_nsites;
+static spinlock spinlock_sites_lock;	// Left zero, so not itself profiled
+
+// Find or make the profile for a spinlock_init() call site.
+static spinlock_site *
+spinlock_site_get(const char *file, int line)
+{
+	spinlock_site *s = NULL;
+	int i;
+
+	spinlock_acquire(&spinlock_sites_lock);
+	for (i = 0; i < spinlock_nsites; i++)
+		if (spinlock_sites[i].line == line &&
+				strcmp(spinlock_sites[i].file, file) == 0) {
+			s = &spinlock_sites[i];
+			break;
+		}
+	if (s == NULL && spinlock_nsites < SPINLOCK_PROF_SITES) {
+		s = &spinlock_sites[spinlock_nsites++];
+		s->file = file;
+		s->line = line;
+	}
+	spinlock_release(&spinlock_sites_lock);
+	return s;
+}
+#endif
 
 
 void
 spinlock_init_(struct spinlock *lk, const char *file, int line)
 {
-	lk->locked = 0;
+	lk->next = lk->serving = 0;
+	lk->mcs = false;
+	lk->tail = lk->node = NULL;
 	lk->file = file;
 	lk->cpu = NULL;
 	lk->line = line;
 	memset(lk->eips, 0, sizeof(lk->eips));
+#if SPINLOCK_PROF
+	lk->site = spinlock_site_get(file, line);
+#endif
+}
+
+// Queue up for an MCS lock using one of this CPU's queue nodes,
+// and spin on that node until the previous holder passes us the lock.
+// Returns true if we had to wait.
+static bool
+spinlock_mcs_acquire(spinlock *lk)
+{
+	// An interrupt handler might take an MCS lock of its own:
+	// don't let it pick the same node.
+	cpu_cli();
+	cpu *c = cpu_cur();
+	int i;
+	for (i = 0; c->mcsused & (1 << i); i++)
+		if (i == SPINLOCK_MCSNODES - 1)
+			panic("spinlock: CPU holds too many MCS locks");
+	c->mcsused |= 1 << i;
+	cpu_sti();
+
+	spinlock_mcsnode *node = &c->mcsnode[i];
+	node->next = NULL;
+	node->wait = 1;
+	spinlock_mcsnode *pred = (spinlock_mcsnode *)
+		xchg((volatile uint32_t *) &lk->tail, (uint32_t) node);
+	if (pred != NULL) {
+		pred->next = node;
+		while (node->wait)
+			pause();
+	}
+	lk->node = node;
+	return pred != NULL;
+}
+
+// Pass an MCS lock to the next CPU in its queue, if any.
+static void
+spinlock_mcs_release(spinlock *lk)
+{
+	cpu *c = cpu_cur();
+	spinlock_mcsnode *node = lk->node;
+
+	if (node->next == NULL) {
+		// No one else queued: try to mark the lock free.
+		if (cmpxchg((volatile uint32_t *) &lk->tail,
+				(uint32_t) node, 0) == (uint32_t) node)
+			goto done;
+		// Someone is just queueing up behind us: wait for them.
+		while (node->next == NULL)
+			pause();
+	}
+	node->next->wait = 0;
+done:
+	cpu_cli();
+	c->mcsused &= ~(1 << (node - c->mcsnode));
+	cpu_sti();
 }
 
 // Acquire the lock.
@@ -37,17 +148,48 @@ spinlock_init_(struct spinlock *lk, const char *file, int line)
 void
 spinlock_acquire(struct spinlock *lk)
 {
+#if PIOS_DEBUG >= 1
 	if (spinlock_holding(lk)) {
 		panic("the current CPU is already holding the spinlock");
 	}
+#endif
 
-	for (;;) {
-		if (!xchg(&lk->locked, 1)) {
-			lk->cpu = cpu_cur();
-			debug_trace(read_ebp(),lk->eips);
-			return;
-		}
-		pause();
+#if SPINLOCK_PROF
+	uint64_t start = rdtsc();
+#endif
+	bool contended;
+	if (lk->mcs)
+		contended = spinlock_mcs_acquire(lk);
+	else {
+		// Take a ticket and wait for our number to come up.
+		uint32_t t = xadd(&lk->next, 1);
+		contended = lk->serving != t;
+		while (lk->serving != t)
+			pause();
+	}
+
+	lk->cpu = cpu_cur();
+#if PIOS_DEBUG >= 1 || SPINLOCK_PROF
+	lk->acquired = rdtsc();
+#endif
+#if SPINLOCK_PROF
+	if (lk->site != NULL) {
+		spinlock_prof *p = &lk->site->cpu[lk->cpu->num];
+		uint64_t spin = lk->acquired - start;
+		p->nacquire++;
+		p->ncontended += contended;
+		p->spincycles += spin;
+		p->spinmax = MAX(p->spinmax, spin);
+	}
+#else
+	(void) contended;
+#endif
+
+	if (spinlock_traceall)
+		debug_trace(read_ebp(),lk->eips);
+	else {
+		lk->eips[0] = (uint32_t) __builtin_return_address(0);
+		lk->eips[1] = 0;
 	}
 }
 
@@ -55,21 +197,84 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+#if PIOS_DEBUG >= 1
 	if (!spinlock_holding(lk)) {
 		panic("the current CPU is not holding the spinlock");
 	}
+#endif
+#if PIOS_DEBUG >= 1 || SPINLOCK_PROF
+	uint64_t hold = rdtsc() - lk->acquired;
+#endif
+	uint32_t eip = lk->eips[0];
+	lk->eips[0] = 0;
+
+#if SPINLOCK_PROF
+	if (lk->site != NULL) {
+		spinlock_prof *p = &lk->site->cpu[lk->cpu->num];
+		p->holdcycles += hold;
+		p->holdmax = MAX(p->holdmax, hold);
+	}
+#endif
 
-	xchg(&lk->locked, 0);
+	// Clear the owner before letting the next CPU in, not after.
 	lk->cpu = NULL;
-	memset(lk->eips, 0, sizeof(lk->eips));
+	if (lk->mcs)
+		spinlock_mcs_release(lk);
+	else {
+		// Only the holder writes 'serving', so this needn't be atomic,
+		// but the compiler mustn't move critical section accesses below.
+		asm volatile("" : : : "memory");
+		lk->serving++;
+	}
+
+#if PIOS_DEBUG >= 1
+	// Only now, with the lock free and held too long already,
+	// spend the time to walk the stack.  The caller that acquired
+	// the lock is usually the one releasing it, so our own stack
+	// mostly says where it was held.  The console lock is exempt:
+	// printing is slow, and complaining about it would print more.
+	uint64_t limit = pit_tschz / 1000 * SPINLOCK_HOLDWARN_MS;
+	if (limit != 0 && hold > limit && lk != &cons_lock) {
+		uint32_t eips[DEBUG_TRACEFRAMES];
+		int i;
+		warn("spinlock %s:%d held %lld cycles, acquired at %08x",
+			lk->file, lk->line, hold, eip);
+		debug_trace(read_ebp(), eips);
+		for (i = 0; i < DEBUG_TRACEFRAMES && eips[i] != 0; i++)
+			cprintf("  from %08x\n", eips[i]);
+	}
+#else
+	(void) eip;
+#endif
+}
+
+// Acquire a lock that interrupt handlers may also take,
+// disabling interrupts on this CPU until the lock is released.
+void
+spinlock_acquire_irqsave(spinlock *lk)
+{
+	cpu_cli();
+	spinlock_acquire(lk);
+	if (!spinlock_traceall)
+		lk->eips[0] = (uint32_t) __builtin_return_address(0);
+}
+
+// Release a lock taken with spinlock_acquire_irqsave(),
+// re-enabling interrupts if they were enabled before.
+void
+spinlock_release_irqrestore(spinlock *lk)
+{
+	spinlock_release(lk);
+	cpu_sti();
 }
 
 // Check whether this cpu is holding the lock.
 int
 spinlock_holding(spinlock *lock)
 {
-	//panic("spinlock_holding() not implemented");
-	return lock->locked && lock->cpu == cpu_cur();
+	// Only this CPU can set lock->cpu to itself,
+	// and it clears it again before releasing the lock.
+	return lock->cpu == cpu_cur();
 }
 
 // Function that simply recurses to a specified depth.
@@ -97,6 +302,9 @@ void spinlock_check()
 	// Make sure that all locks have the correct debug info.
 	for(i=0;i<NUMLOCKS;i++) assert(locks[i].file==file);
 
+	// Record full call stacks for these runs.
+	bool traceall = spinlock_traceall;
+	spinlock_traceall = true;
 	for (run=0;run<NUMRUNS;run++) 
 	{
 		// Lock all locks
@@ -129,6 +337,225 @@ void spinlock_check()
 		// Make sure that all locks have holding correctly implemented.
 		for(i=0;i<NUMLOCKS;i++) assert(spinlock_holding(&locks[i]) == 0);
 	}
+
+	// Normally only the caller of spinlock_acquire() is recorded.
+	spinlock_traceall = false;
+	for(i=0;i<NUMLOCKS;i++) spinlock_godeep(i, &locks[i]);
+	for(i=0;i<NUMLOCKS;i++) {
+		assert(locks[i].eips[0] >= (uint32_t)spinlock_godeep);
+		assert(locks[i].eips[0] < (uint32_t)spinlock_godeep+100);
+		assert(locks[i].eips[1] == 0);
+	}
+	for(i=0;i<NUMLOCKS;i++) spinlock_release(&locks[i]);
+	for(i=0;i<NUMLOCKS;i++) assert(locks[i].eips[0]==0);
+	spinlock_traceall = traceall;
+
+	// Check MCS locks, holding as many as we can at once
+	// and releasing them out of order.
+	for(i=0;i<SPINLOCK_MCSNODES;i++) {
+		spinlock_init_mcs(&locks[i]);
+		assert(locks[i].mcs && locks[i].tail == NULL);
+	}
+	for (run=0;run<NUMRUNS;run++)
+	{
+		for(i=0;i<SPINLOCK_MCSNODES;i++) {
+			spinlock_acquire(&locks[i]);
+			assert(spinlock_holding(&locks[i]));
+			assert(locks[i].tail == locks[i].node);
+		}
+		assert(cpu_cur()->mcsused == (1 << SPINLOCK_MCSNODES) - 1);
+		for(i=0;i<SPINLOCK_MCSNODES;i++) {
+			j = (i + run) % SPINLOCK_MCSNODES;
+			spinlock_release(&locks[j]);
+			assert(!spinlock_holding(&locks[j]));
+			assert(locks[j].tail == NULL);
+		}
+		assert(cpu_cur()->mcsused == 0);
+	}
+
+#if SPINLOCK_PROF
+	// All the locks above share one init site, which has counted
+	// every acquisition, none of which had to wait.
+	spinlock_prof *p = &locks[0].site->cpu[cpu_cur()->num];
+	for(i=1;i<NUMLOCKS;i++) assert(locks[i].site == locks[0].site);
+	assert(p->nacquire ==
+		(NUMLOCKS + SPINLOCK_MCSNODES) * NUMRUNS + NUMLOCKS);
+	assert(p->ncontended == 0);
+	assert(p->holdcycles > 0 && p->holdmax <= p->holdcycles);
+#endif
+
+	// Check that irqsave locks keep interrupts off until the last release,
+	// then restore whatever state they found.
+	cpu *c = cpu_cur();
+	bool intena = (read_eflags() & FL_IF) != 0;
+	assert(c->ncli == 0);
+	spinlock_acquire_irqsave(&locks[0]);
+	spinlock_acquire_irqsave(&locks[1]);
+	assert(c->ncli == 2 && !(read_eflags() & FL_IF));
+	spinlock_release_irqrestore(&locks[0]);
+	assert(c->ncli == 1 && !(read_eflags() & FL_IF));
+	spinlock_release_irqrestore(&locks[1]);
+	assert(c->ncli == 0 && ((read_eflags() & FL_IF) != 0) == intena);
 	cprintf("spinlock_check() succeeded!\n");
 }
 
+
+void
+spinlock_stat(lockstat *ls)
+{
+	memset(ls, 0, sizeof(*ls));
+#if SPINLOCK_PROF
+	// Other CPUs' counters may be changing under us: that's OK.
+	int i, j;
+	for (i = 0; i < spinlock_nsites; i++) {
+		spinlock_site *s = &spinlock_sites[i];
+		lockstat_site ss;
+		memset(&ss, 0, sizeof(ss));
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			spinlock_prof *p = &s->cpu[c->num];
+			ss.nacquire += p->nacquire;
+			ss.ncontended += p->ncontended;
+			ss.spincycles += p->spincycles;
+			ss.spinmax = MAX(ss.spinmax, p->spinmax);
+			ss.holdcycles += p->holdcycles;
+			ss.holdmax = MAX(ss.holdmax, p->holdmax);
+		}
+		if (ss.nacquire == 0)
+			continue;
+
+		// Keep the end of the file name, which says the most.
+		int len = strlen(s->file);
+		const char *f = s->file;
+		if (len >= LOCKSTAT_FILELEN)
+			f += len - (LOCKSTAT_FILELEN - 1);
+		strncpy(ss.file, f, LOCKSTAT_FILELEN - 1);
+		ss.line = s->line;
+
+		// Insert it in order of spin cycles, most first,
+		// dropping whatever falls off the end of the table.
+		for (j = ls->nsite; j > 0; j--) {
+			if (ls->site[j-1].spincycles >= ss.spincycles)
+				break;
+			if (j < LOCKSTAT_MAXSITES)
+				ls->site[j] = ls->site[j-1];
+		}
+		if (j < LOCKSTAT_MAXSITES) {
+			ls->site[j] = ss;
+			if (ls->nsite < LOCKSTAT_MAXSITES)
+				ls->nsite++;
+		}
+	}
+#endif
+}
+
+void
+spinlock_stat_print(const lockstat *ls)
+{
+	if (!SPINLOCK_PROF) {
+		cprintf("lock: profiling not built in (SPINLOCK_PROF=0)\n");
+		return;
+	}
+
+	cprintf("lock: top contended spinlocks, by cycles spent spinning\n");
+	cprintf("lock: %-28s %8s %8s %10s %10s %10s %10s\n", "init site",
+		"acquires", "waited", "spin/acq", "spinmax",
+		"hold/acq", "holdmax");
+	int i;
+	for (i = 0; i < ls->nsite; i++) {
+		const lockstat_site *s = &ls->site[i];
+		cprintf("lock: %23s:%-4d %8d %8d %10lld %10lld %10lld %10lld\n",
+			s->file, s->line, s->nacquire, s->ncontended,
+			s->spincycles / s->nacquire, s->spinmax,
+			s->holdcycles / s->nacquire, s->holdmax);
+	}
+}
+
+// Per-CPU results of spinlock_bench()
+static uint32_t spinlock_bench_acq[CPU_MAX];	// Acquisitions
+static uint64_t spinlock_bench_lat[CPU_MAX];	// Total cycles waited
+static uint64_t spinlock_bench_max[CPU_MAX];	// Longest wait
+
+// Measure throughput, acquire latency and fairness of ticket and MCS locks
+// with all CPUs contending for the same lock.
+void
+spinlock_bench(void)
+{
+	static const char *kindname[2] = { "ticket", "mcs" };
+	static spinlock lk;
+	static volatile bool stop;
+	static volatile uint32_t count;	// Shared data the lock protects
+	int ncpus = ismp ? ncpu : 1;
+	int kind, i;
+
+	uint64_t window = pit_tschz ? pit_tschz / 1000 * SPINLOCK_BENCH_MS
+				: (uint64_t) SPINLOCK_BENCH_MS * 1000000;
+
+	for (kind = 0; kind < 2; kind++) {
+		if (cpu_onboot()) {
+			if (kind)
+				spinlock_init_mcs(&lk);
+			else
+				spinlock_init(&lk);
+			stop = false;
+			count = 0;
+		}
+		bench_barrier();
+
+		// The boot CPU decides when time is up, so that
+		// we don't depend on all CPUs' TSCs being in sync.
+		uint64_t start = rdtsc();
+		uint32_t acq = 0;
+		uint64_t lat = 0, maxlat = 0;
+		while (!stop) {
+			uint64_t t0 = rdtsc();
+			spinlock_acquire(&lk);
+			uint64_t t = rdtsc() - t0;
+			count++;
+			spinlock_release(&lk);
+
+			acq++;
+			lat += t;
+			maxlat = MAX(maxlat, t);
+			for (i = 0; i < SPINLOCK_BENCH_DELAY; i++)
+				pause();
+			if (cpu_onboot() && rdtsc() - start >= window)
+				stop = true;
+		}
+		uint64_t cycles = rdtsc() - start;
+		cpu *me = cpu_cur();
+		spinlock_bench_acq[me->num] = acq;
+		spinlock_bench_lat[me->num] = lat;
+		spinlock_bench_max[me->num] = maxlat;
+
+		bench_barrier();
+		if (!cpu_onboot())
+			continue;
+
+		// Fairness is the fewest acquisitions any CPU got,
+		// in thousandths of the most any CPU got.
+		uint64_t sumacq = 0, sumlat = 0, allmax = 0;
+		uint32_t minacq = ~0, maxacq = 0;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			uint32_t a = spinlock_bench_acq[c->num];
+			cprintf("lockbench: ncpu=%d lock=%s cpu=%d "
+				"acquires=%d avglat=%lld maxlat=%lld\n",
+				ncpus, kindname[kind], c->num, a,
+				a ? spinlock_bench_lat[c->num] / a : 0,
+				spinlock_bench_max[c->num]);
+			sumacq += a;
+			sumlat += spinlock_bench_lat[c->num];
+			allmax = MAX(allmax, spinlock_bench_max[c->num]);
+			minacq = MIN(minacq, a);
+			maxacq = MAX(maxacq, a);
+		}
+		assert(count == sumacq);
+		cprintf("lockbench: ncpu=%d lock=%s cpu=all acquires=%lld "
+			"acq/s=%lld avglat=%lld maxlat=%lld fairness=%d\n",
+			ncpus, kindname[kind], sumacq,
+			bench_persec(sumacq, cycles),
+			sumacq ? sumlat / sumacq : 0, allmax,
+			maxacq ? (int) ((uint64_t) minacq * 1000 / maxacq) : 0);
+	}
+}
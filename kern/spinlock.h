@@ -19,24 +19,104 @@
 #include <kern/debug.h>
 
 
+// Spinlocks are fair: CPUs acquire a lock in the order they asked for it.
+// By default a spinlock is a ticket lock, which is small and fast
+// but has all waiters spin on the same cache line.
+// A lock initialized with spinlock_init_mcs() is instead an MCS lock,
+// whose waiters each spin on their own queue node in their cpu struct,
+// so a release disturbs only the next waiter's cache.
+// Use MCS locks for heavily contended locks.
+//
+// The kernel runs with interrupts enabled outside critical sections.
+// A lock that an interrupt handler might take must be acquired with
+// spinlock_acquire_irqsave() everywhere, which keeps interrupts disabled
+// on this CPU until the matching spinlock_release_irqrestore();
+// otherwise the handler could spin forever on a lock its CPU holds.
+
+// Queue node for an MCS lock; each CPU has SPINLOCK_MCSNODES of them,
+// limiting how many MCS locks it can hold or wait for at once.
+#define SPINLOCK_MCSNODES	4
+
+typedef struct spinlock_mcsnode {
+	struct spinlock_mcsnode *volatile next;	// Next waiter in queue
+	volatile uint32_t	wait;		// Cleared when lock passed to us
+} spinlock_mcsnode;
+
+// Building with 'make DEFS=-DSPINLOCK_PROF=1' profiles lock contention:
+// each acquisition and release is timed with rdtsc, and the counters
+// are kept per CPU for each place spinlock_init() is called from.
+// Up to SPINLOCK_PROF_SITES sites are profiled; locks whose site
+// didn't fit in the table, and a zero-filled spinlock that was never
+// passed to spinlock_init(), aren't.
+#ifndef SPINLOCK_PROF
+#define SPINLOCK_PROF		0
+#endif
+#define SPINLOCK_PROF_SITES	32
+
+// Normally spinlock_acquire() records only its caller's EIP in eips[0],
+// since walking the whole call stack would lengthen every critical section.
+// It records full call stacks while spinlock_traceall is set,
+// which it is by default in PIOS_DEBUG=2 builds.
+// Debug builds instead catch locks held for over SPINLOCK_HOLDWARN_MS
+// milliseconds when they are released, and warn with a full trace then.
+#ifndef SPINLOCK_HOLDWARN_MS
+#define SPINLOCK_HOLDWARN_MS	100
+#endif
+
+extern bool spinlock_traceall;
+
 // Mutual exclusion lock.
+// A zero-filled spinlock is a valid, unlocked ticket lock.
 typedef struct spinlock {
-	uint32_t locked;	// Is the lock held?
+	volatile uint32_t next;		// Ticket: next ticket to hand out
+	volatile uint32_t serving;	// Ticket: ticket now holding the lock
+
+	bool		mcs;		// True if this is an MCS lock
+	spinlock_mcsnode *volatile tail; // MCS: last CPU in queue, or NULL
+	spinlock_mcsnode *node;		// MCS: queue node of the holder
 
 	// For debugging:
 	const char *file;	// Source file where spinlock_init() was called
 	int line;		// Line number of spinlock_init()
 	struct cpu *cpu;	// The cpu holding the lock.
 	uint32_t eips[DEBUG_TRACEFRAMES]; // Call stack that locked the lock.
+#if PIOS_DEBUG >= 1 || SPINLOCK_PROF
+	uint64_t	acquired;	// TSC when last acquired
+#endif
+
+#if SPINLOCK_PROF
+	struct spinlock_site *site;	// Profile for our init site, or NULL
+#endif
 } spinlock;
 
+// Parameters for spinlock_bench(), which runs when built with 'make BENCH=1'.
+// All CPUs hammer on one lock for SPINLOCK_BENCH_MS milliseconds,
+// doing SPINLOCK_BENCH_DELAY pause()s between acquisitions,
+// first with a ticket lock, then with an MCS lock.
+#ifndef SPINLOCK_BENCH_MS
+#define SPINLOCK_BENCH_MS	200
+#endif
+#ifndef SPINLOCK_BENCH_DELAY
+#define SPINLOCK_BENCH_DELAY	16
+#endif
+
 #define spinlock_init(lk)	spinlock_init_(lk, __FILE__, __LINE__)
+#define spinlock_init_mcs(lk)	\
+	do { spinlock_init(lk); (lk)->mcs = true; } while (0)
 
 
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
 void spinlock_release(spinlock *lk);
+void spinlock_acquire_irqsave(spinlock *lk);
+void spinlock_release_irqrestore(spinlock *lk);
 int spinlock_holding(spinlock *lk);
 void spinlock_check();
+void spinlock_bench(void);
+
+// Take a snapshot of the lock contention profile, and print one.
+struct lockstat;
+void spinlock_stat(struct lockstat *ls);
+void spinlock_stat_print(const struct lockstat *ls);
 
 #endif /* !PIOS_KERN_SPINLOCK_H */
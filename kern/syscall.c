@@ -13,12 +13,17 @@
 #include <inc/assert.h>
 #include <inc/trap.h>
 #include <inc/syscall.h>
+#include <inc/kstat.h>
 
 #include <kern/cpu.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
+#include <kern/proctrace.h>
+#include <kern/mem.h>
 #include <kern/syscall.h>
 
+#include <dev/lapic.h>
+
 
 
 
@@ -110,10 +115,29 @@ do_put(trapframe *tf, uint32_t cmd)
 	if (flags & SYS_REGS) {
 		proc_save(child, &child_state->tf, PROC_SYSCALL_COMPLETE);
 	}
+	if (flags & SYS_SCHED) {
+		procsched *ps = &child->sv.sched;
+		*ps = child_state->sched;
+		if (ps->quantum != 0)
+			ps->quantum = MAX(LAPIC_TICK_MIN,
+					MIN(ps->quantum, LAPIC_TICK_MAX));
+
+		// Ignore CPUs we don't have; none left means any CPU.
+		uint32_t cpus = 0;
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			cpus |= 1 << c->num;
+		ps->affinity &= cpus;
+
+		if (!proc_setgang(child, ps->gang))
+			ps->gang = 0;	// out of memory: left its old gang
+		if (!proc_setrt(child))
+			ps->period = ps->budget = 0;	// refused: best-effort
+	}
 
-	// run the child (all children go thru ready queue)
+	// run the child, straight away if we wait for it next
 	if (flags & SYS_START) {
-		proc_ready(child);
+		proc_handoff(child);
 	}
 
 	trap_return(tf);
@@ -146,11 +170,78 @@ do_get(trapframe *tf, uint32_t cmd)
 	if (flags & SYS_REGS) {
 		memmove(&save->tf, &child->sv.tf, sizeof(trapframe));
 	}
+	if (flags & SYS_SCHED) {
+		save->sched = child->sv.sched;
+	}
+
+	trap_return(tf);
+}
+
+
+static void
+do_stat(trapframe *tf, uint32_t cmd)
+{
+	// Only the root process gets to see what the kernel is up to.
+	if (proc_cur() != proc_root)
+		trap_return(tf);
+
+	void *buf = (void *) tf->regs.ebx;
+	switch (tf->regs.edx) {
+	case STAT_MEM: {
+		memstat ms;
+		mem_stat(&ms);
+		if (cmd & SYS_PRINT)
+			mem_stat_print(&ms);
+		if (buf)
+			memmove(buf, &ms, sizeof(ms));
+		break;
+	    }
+	case STAT_LOCK: {
+		// Too big for the kernel stack, but only one CPU can be
+		// running the root process and hence be in here.
+		static lockstat ls;
+		spinlock_stat(&ls);
+		if (cmd & SYS_PRINT)
+			spinlock_stat_print(&ls);
+		if (buf)
+			memmove(buf, &ls, sizeof(ls));
+		break;
+	    }
+	case STAT_SCHED: {
+		static schedstat ss;
+		proc_stat(&ss);
+		if (cmd & SYS_PRINT)
+			proc_stat_print(&ss);
+		if (buf)
+			memmove(buf, &ss, sizeof(ss));
+		break;
+	    }
+	case STAT_TRACE: {
+		static schedtrace st;
+		proctrace_get(&st);
+		if (cmd & SYS_PRINT)
+			proctrace_print(&st);
+		if (buf)
+			memmove(buf, &st, sizeof(st));
+		break;
+	    }
+	default:
+		warn("sys_stat: unknown statistics %d", tf->regs.edx);
+	}
 
 	trap_return(tf);
 }
 
 
+static void
+do_yield(trapframe *tf, uint32_t cmd)
+{
+	// Take turns with any process ready on this CPU,
+	// putting ourselves at the back of our priority level's queue.
+	proc_switch(tf, PROC_NPRIO-1);
+}
+
+
 static void
 do_ret(trapframe *tf, uint32_t cmd)
 {
@@ -180,6 +271,8 @@ syscall(trapframe *tf)
 	case SYS_PUT:	return do_put(tf, cmd);
 	case SYS_GET:	return do_get(tf, cmd);
 	case SYS_RET:	return do_ret(tf, cmd);
+	case SYS_STAT:	return do_stat(tf, cmd);
+	case SYS_YIELD:	return do_yield(tf, cmd);
 	default:	return;		// handle as a regular trap
 	}
 }
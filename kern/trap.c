@@ -61,6 +61,7 @@ extern void th_secev(void);
 extern void th_syscall(void);
 extern void th_ltimer(void);
 extern void th_spurious(void);
+extern void th_resched(void);
 
 
 static void
@@ -93,6 +94,7 @@ trap_init_idt(void)
 	SETGATE(idt[T_SYSCALL],0,CPU_GDT_KCODE,th_syscall,3)
 	SETGATE(idt[T_LTIMER],0,CPU_GDT_KCODE,th_ltimer,3)
 	SETGATE(idt[T_IRQ0 + IRQ_SPURIOUS],0,CPU_GDT_KCODE,th_spurious,3)
+	SETGATE(idt[T_RESCHED],0,CPU_GDT_KCODE,th_resched,0)
 
 
 
@@ -186,12 +188,18 @@ trap(trapframe *tf)
 	asm volatile("cld" ::: "cc");
 
 	// If this trap was anticipated, just use the designated handler.
+	// Interrupts are never anticipated, only processor exceptions.
 	cpu *c = cpu_cur();
-	if (c->recover)
+	if (c->recover && tf->trapno < T_IRQ0)
 		c->recover(tf, c->recoverdata);
 
 	// Lab 2: your trap handling code here!
 	if (tf->trapno == T_SYSCALL) {
+		// The user process holds no locks, and interrupts taken
+		// in the kernel don't switch processes (see do_ltimer()),
+		// so there's no need to hold off interrupts during syscalls.
+		assert(c->ncli == 0);
+		sti();
 		syscall(tf);
 	}
 
@@ -203,6 +211,10 @@ trap(trapframe *tf)
 		local_apic(tf);
 	}
 
+	if (tf->trapno == T_RESCHED) {
+		local_apic(tf);
+	}
+
 	if (tf->trapno >= T_DIVIDE && tf->trapno <= T_SECEV) {
 		if (tf->cs & 3) {
 			proc_ret(tf, PROC_TRAP_REFLECT);
@@ -212,7 +224,7 @@ trap(trapframe *tf)
 	// If we panic while holding the console lock,
 	// release it so we don't get into a recursive panic that way.
 	if (spinlock_holding(&cons_lock))
-		spinlock_release(&cons_lock);
+		spinlock_release_irqrestore(&cons_lock);
 	trap_print(tf);
 	panic("unhandled trap");
 }
@@ -220,7 +232,10 @@ trap(trapframe *tf)
 void gcc_noreturn
 trap_return(trapframe *tf)
 {
-	tf->eflags = tf->eflags | FL_IF;	//interrupt flag for preemption
+	// User code always runs with interrupts enabled, for preemption;
+	// kernel code gets back whatever interrupt state it was in.
+	if (tf->cs & 3)
+		tf->eflags = tf->eflags | FL_IF;
 	trap_return_(tf);
 }
 
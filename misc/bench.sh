@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Run the in-kernel benchmarks (see kern/bench.h) under QEMU
+# with 1 up to MAXCPU processors, and summarize how they scale.
+#
+# Usage: sh misc/bench.sh [-v] [bench [maxcpu]]
+#	bench	benchmark whose results to summarize (default: membench;
+#		lockbench measures spinlock contention,
+#		procbench process switching, spawning and yielding)
+#	maxcpu	largest number of CPUs to try (default: 8)
+#
+# 'make bench' runs this script (see GNUmakefile).
+# Builds a release kernel with 'make BENCH=1 PIOS_DEBUG=0'.
+# All benchmark output lines go to bench-out;
+# for each CPU count, the script prints that benchmark's all-CPU totals
+# one line per run, with the values in the order the kernel printed them:
+# for membench, for example, that is
+#	ncpu batch ops cycles cyc/op ops/s
+# and for procbench, one line for each of its benchmarks,
+#	ncpu op nproc ops cyc/op ops/s
+# which can be fed directly to gnuplot or a spreadsheet.
+
+out=/dev/null
+if [ "x$1" = "x-v" ]; then
+	out=/dev/stdout
+	shift
+fi
+bench=${1:-membench}
+maxcpu=${2:-8}
+timeout=120
+
+if gmake --version >/dev/null 2>&1; then make=gmake; else make=make; fi
+qemu=`$SHELL misc/which-qemu.sh` || exit 1
+
+$make BENCH=1 PIOS_DEBUG=0 >$out || exit 1
+img=obj-release-bench/kern/kernel.img
+
+rm -f bench-out
+ncpu=1
+while [ $ncpu -le $maxcpu ]; do
+	rm -f bench-run
+	(
+		ulimit -t $timeout
+		exec $qemu -nographic -hda $img -smp $ncpu -m 1100M \
+			-serial file:bench-run -monitor null -no-reboot
+	) </dev/null >$out 2>&1 &
+	pid=$!
+
+	# Wait for the kernel to finish its benchmarks (or die trying).
+	while kill -0 $pid 2>/dev/null && \
+			! grep -q "^bench: done" bench-run 2>/dev/null; do
+		sleep 1
+	done
+	kill $pid >/dev/null 2>&1
+	wait $pid 2>/dev/null
+
+	if ! grep -q "^bench: done" bench-run 2>/dev/null; then
+		echo "*** $ncpu CPUs: benchmarks did not finish" 1>&2
+	fi
+	grep "^[a-z]*bench:" bench-run >>bench-out
+
+	# Print the all-CPU totals of the benchmark we're summarizing,
+	# with a header naming the columns before the first run's results.
+	grep "^$bench: .* cpu=all " bench-run | tr -d '\r' | \
+	awk -v header=`expr $ncpu = 1` '{
+		keys = vals = ""
+		for (i = 2; i <= NF; i++) {
+			split($i, kv, "=")
+			if (kv[1] == "cpu")
+				continue
+			keys = keys " " kv[1]; vals = vals " " kv[2]
+		}
+		if (header) print "#" keys
+		header = 0
+		print substr(vals, 2)
+	}'
+	ncpu=`expr $ncpu + 1`
+done
+rm -f bench-run